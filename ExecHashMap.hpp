@@ -1,44 +1,107 @@
 #ifndef EXEC_HASH_MAP_HPP
 #define EXEC_HASH_MAP_HPP
 
-#include <iostream>
-#include <iterator>
-#include <numeric>
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
-#include <nlohmann/json.hpp>
+#include "JsonWriter.hpp"
+#include "ValuePool.hpp"
 
 typedef std::vector<std::string> IOVector;
 typedef std::pair<IOVector, IOVector> IOPair;
 
 /**
- * @brief A hash map that maps inputs to a vector of outputs
- * @details Key is inputs (a vector), value is a vector of outputs
- * (a vector of vectors) of multiple executions
+ * @brief Handle of the stored inputs or outputs of an observation
+ * @details the reporter decides how values are stored in the ValuePool, e.g.
+ * as an interned IOSpan, and converts them back to an IOVector at dump
+ */
+typedef const void *StoredValues;
+
+/**
+ * @brief A flat hash map that maps inputs to the outputs of multiple
+ * executions, for all functions at once
+ * @details Key is (function ID, hash of the inputs). Every key has a record,
+ * records are stored contiguously and found through an open-addressing index
+ * of record numbers. The outputs of a record are stored inline in a fixed
+ * array of value_capacity (hash, StoredValues) slots, so looking up a
+ * repeated observation touches the index, the record and its output array
+ * only. The values themselves are stored in a ValuePool.
  */
 class ExecHashMap {
 private:
-  struct VectorHasher {
-    // https://stackoverflow.com/questions/20511347/a-good-hash-function-for-a-vector
-    // XOR of each string's hash value
-    size_t operator()(const IOVector &V) const {
-      std::hash<std::string> hasher;
-      size_t seed = 0;
-      for (const auto &str : V) {
-        seed ^= hasher(str) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-      }
-      return seed;
-    }
+  struct Record {
+    uint64_t input_hash;
+    uint32_t func_id;
+    uint32_t num_outputs;
+    // null once the values are released by release_flushed
+    StoredValues inputs;
+    // outputs written by the last flush, the rest are pending
+    uint32_t num_flushed;
+  };
+
+  struct Output {
+    uint64_t hash;
+    StoredValues outputs;
   };
 
-  typedef std::unordered_set<IOVector, VectorHasher> IOVectorSet;
-  std::unordered_map<IOVector, IOVectorSet, VectorHasher> map;
+  // record number + 1 of each slot, 0 marks an empty slot
+  std::vector<uint32_t> index;
+  std::vector<Record> records;
+  // outputs of records[i] are outputs[i * value_capacity, ...)
+  std::vector<Output> outputs;
+  ValuePool pool;
   int value_capacity;
 
+  static size_t slot_of(uint32_t func_id, uint64_t input_hash) {
+    return input_hash ^ ((uint64_t)func_id * 0x9e3779b97f4a7c15ull);
+  }
+
+  void grow() {
+    std::vector<uint32_t> bigger(index.size() * 2, 0);
+    size_t mask = bigger.size() - 1;
+    for (uint32_t r = 0; r < records.size(); r++) {
+      size_t i = slot_of(records[r].func_id, records[r].input_hash) & mask;
+      while (bigger[i]) {
+        i = (i + 1) & mask;
+      }
+      bigger[i] = r + 1;
+    }
+    index.swap(bigger);
+  }
+
+  /**
+   * @brief Find the record of a key, inserting an empty one if needed
+   * @param inserted: set to true if the record was inserted
+   * @return record number
+   */
+  uint32_t find_or_insert(uint32_t func_id, uint64_t input_hash,
+                          bool &inserted) {
+    if ((records.size() + 1) * 2 > index.size()) {
+      grow();
+    }
+    size_t mask = index.size() - 1;
+    for (size_t i = slot_of(func_id, input_hash) & mask;; i = (i + 1) & mask) {
+      if (index[i] == 0) {
+        index[i] = records.size() + 1;
+        records.push_back(Record{input_hash, func_id, 0, nullptr, 0});
+        outputs.resize(outputs.size() + value_capacity);
+        inserted = true;
+        return records.size() - 1;
+      }
+      const Record &rec = records[index[i] - 1];
+      if (rec.input_hash == input_hash && rec.func_id == func_id) {
+        inserted = false;
+        return index[i] - 1;
+      }
+    }
+  }
+
 public:
   ExecHashMap() : ExecHashMap(0) {}
 
@@ -46,86 +109,424 @@ public:
    * @brief Construct a new Exec Hash Map object
    * @param cap the capacity of the value vector (maxmium length)
    */
-  ExecHashMap(int cap) : value_capacity(cap) {}
+  ExecHashMap(int cap) : index(1024, 0), value_capacity(cap) {}
 
   /**
-   * @brief Insert a pair of inputs and outputs to the hash map
-   * @param io: a pair of inputs (vector) and outputs (vector)
+   * @brief Insert an observation of a function's inputs and outputs
+   * @details the values are only stored if the observation is new
+   * @param func_id: ID of the function
+   * @param input_hash: hash of the inputs
+   * @param output_hash: hash of the outputs
+   * @param make_inputs: callable storing the inputs into a ValuePool&
+   * @param make_outputs: callable storing the outputs into a ValuePool&,
+   * also passed the StoredValues of the inputs they belong to
+   * @return true if the inputs were not reported for the function before
    */
-  void insert(IOPair &io) {
-    IOVector &inputs = io.first;
-    IOVector &outputs = io.second;
+  template <typename MakeInputs, typename MakeOutputs>
+  bool insert(uint32_t func_id, uint64_t input_hash, uint64_t output_hash,
+              MakeInputs make_inputs, MakeOutputs make_outputs) {
+    bool inserted;
+    uint32_t r = find_or_insert(func_id, input_hash, inserted);
+    if (inserted) {
+      records[r].inputs = make_inputs(pool);
+    }
 
     // for the same input vector, we cap the number of outputs to value_capacity
     // `value_capacity` should be set so
     // the model can know if the function is "honest" or not
-    if (map[inputs].size() < value_capacity) {
-      map[inputs].insert(outputs);
+    Record &rec = records[r];
+    Output *outs = &outputs[(size_t)r * value_capacity];
+    if (rec.num_outputs >= (uint32_t)value_capacity) {
+      return inserted;
+    }
+    for (uint32_t i = 0; i < rec.num_outputs; i++) {
+      if (outs[i].hash == output_hash) {
+        return inserted;
+      }
     }
+    if (!rec.inputs) {
+      // flushed before, the new output is written with its inputs again
+      rec.inputs = make_inputs(pool);
+    }
+    outs[rec.num_outputs++] =
+        Output{output_hash, make_outputs(pool, rec.inputs)};
+    return inserted;
+  }
+
+  /// @brief Check if the inputs were reported for the function before
+  bool contains(uint32_t func_id, uint64_t input_hash) const {
+    size_t mask = index.size() - 1;
+    for (size_t i = slot_of(func_id, input_hash) & mask; index[i];
+         i = (i + 1) & mask) {
+      const Record &rec = records[index[i] - 1];
+      if (rec.input_hash == input_hash && rec.func_id == func_id) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  int size() const { return records.size(); }
+
+  uint32_t func_of(uint32_t r) const { return records[r].func_id; }
+  StoredValues inputs_of(uint32_t r) const { return records[r].inputs; }
+  uint32_t num_outputs(uint32_t r) const { return records[r].num_outputs; }
+  uint32_t num_flushed(uint32_t r) const { return records[r].num_flushed; }
+  StoredValues output_of(uint32_t r, uint32_t i) const {
+    return outputs[(size_t)r * value_capacity + i].outputs;
   }
 
   /**
-   * @brief Get the outputs of a given input
-   * @param xs: inputs
-   * @return a vector of outputs
+   * @brief Call f(func_id, inputs, outputs) for every record
+   * @details outputs is a vector of the record's stored outputs
    */
-  IOVectorSet &operator[](const IOVector &xs) { return map[xs]; }
+  template <typename F> void for_each(F f) const {
+    std::vector<StoredValues> outs;
+    for (uint32_t r = 0; r < records.size(); r++) {
+      const Record &rec = records[r];
+      outs.clear();
+      for (uint32_t i = 0; i < rec.num_outputs; i++) {
+        outs.push_back(outputs[(size_t)r * value_capacity + i].outputs);
+      }
+      f(rec.func_id, rec.inputs, outs);
+    }
+  }
 
-  int size() { return map.size(); }
+  const ValuePool &values() const { return pool; }
 
-  nlohmann::json to_json() const {
-    nlohmann::json j;
-    for (auto &kv : map) {
-      const IOVector &input = kv.first;
-      const IOVectorSet &outputs = kv.second;
-      j += nlohmann::json{input, outputs};
+  /**
+   * @brief Mark all outputs flushed and release the stored values
+   * @details the keys and output hashes are kept, so observations that were
+   * flushed are still not reported again
+   */
+  void release_flushed() {
+    for (uint32_t r = 0; r < records.size(); r++) {
+      Record &rec = records[r];
+      rec.num_flushed = rec.num_outputs;
+      rec.inputs = nullptr;
+      for (uint32_t i = 0; i < rec.num_outputs; i++) {
+        outputs[(size_t)r * value_capacity + i].outputs = nullptr;
+      }
     }
-    return j;
+    pool.clear();
+  }
+
+  /**
+   * @brief Remove all records and release the interned values at once
+   */
+  void clear() {
+    std::vector<uint32_t>(1024, 0).swap(index);
+    std::vector<Record>().swap(records);
+    std::vector<Output>().swap(outputs);
+    pool.clear();
   }
 };
 
+/**
+ * @brief Reports of all functions, safe to use from multiple threads
+ * @details functions are split into NUM_SHARDS shards by function ID, each
+ * with its own lock, ExecHashMap and ValuePool, so threads running different
+ * functions rarely contend. All reports of a function live in one shard, and
+ * the shards are merged in function ID order when the table is dumped.
+ * New observations are formatted and stored in the ValuePool while the
+ * shard is locked, so the lock is a mutex that puts waiting threads to
+ * sleep rather than a spin lock.
+ */
 class ReportTable {
 private:
-  // <function_name, its_executions>
-  std::unordered_map<std::string, ExecHashMap> table;
+  static const uint32_t NUM_SHARDS = 64;
+
+  struct Shard {
+    std::mutex lock;
+    // executions of the shard's functions
+    ExecHashMap table;
+    // <function_name> by func_id / NUM_SHARDS
+    std::vector<std::string> names;
+    // number of distinct inputs by func_id / NUM_SHARDS
+    std::vector<int> inputs_per_func;
+
+    Shard(int cap) : table(cap) {}
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards;
 
-  // allow at most max_outputs_for_input outputs for a given input
-  int max_outputs_for_input;
+  Shard &shard_of(uint32_t func_id) { return *shards[func_id % NUM_SHARDS]; }
+
+  // chunks formatted in parallel hold at least this many records
+  static constexpr size_t MIN_CHUNK_RECORDS = 4096;
+
+  /// @brief Order the records are written in
+  struct RecordOrder {
+    // only write the outputs that were not flushed yet
+    bool pending_only;
+    // record numbers of every shard sorted by function, the records of
+    // function func_id are order[s][first[s][local], first[s][local + 1])
+    std::vector<std::vector<uint32_t>> order, first;
+    // IDs of the functions with records to write, ascending
+    std::vector<uint32_t> funcs;
+
+    uint32_t num_records_of(uint32_t func_id) const {
+      const std::vector<uint32_t> &begin = first[func_id % NUM_SHARDS];
+      uint32_t local = func_id / NUM_SHARDS;
+      // shards only know the functions that reported to them so far
+      if (local + 1 >= begin.size()) {
+        return 0;
+      }
+      return begin[local + 1] - begin[local];
+    }
+  };
+
+  std::vector<std::unique_lock<std::mutex>> lock_all() {
+    std::vector<std::unique_lock<std::mutex>> guards;
+    for (std::unique_ptr<Shard> &shard : shards) {
+      guards.emplace_back(shard->lock);
+    }
+    return guards;
+  }
+
+  /// @brief Sort the records to write by function, all shards must be locked
+  void sort_records(RecordOrder &order) const {
+    order.order.assign(NUM_SHARDS, std::vector<uint32_t>());
+    order.first.assign(NUM_SHARDS, std::vector<uint32_t>());
+    uint32_t num_funcs = 0;
+    for (uint32_t s = 0; s < NUM_SHARDS; s++) {
+      const ExecHashMap &table = shards[s]->table;
+      auto selected = [&](uint32_t r) {
+        return !order.pending_only ||
+               table.num_flushed(r) < table.num_outputs(r);
+      };
+      std::vector<uint32_t> &begin = order.first[s];
+      begin.assign(shards[s]->names.size() + 1, 0);
+      for (uint32_t r = 0; r < (uint32_t)table.size(); r++) {
+        if (selected(r)) {
+          begin[table.func_of(r) / NUM_SHARDS + 1]++;
+        }
+      }
+      for (size_t local = 1; local < begin.size(); local++) {
+        begin[local] += begin[local - 1];
+      }
+      std::vector<uint32_t> next(begin.begin(), begin.end() - 1);
+      order.order[s].resize(begin.back());
+      for (uint32_t r = 0; r < (uint32_t)table.size(); r++) {
+        if (selected(r)) {
+          order.order[s][next[table.func_of(r) / NUM_SHARDS]++] = r;
+        }
+      }
+      if (begin.size() > 1) {
+        num_funcs = std::max<uint32_t>(
+            num_funcs, (begin.size() - 2) * NUM_SHARDS + s + 1);
+      }
+    }
+    order.funcs.clear();
+    for (uint32_t func_id = 0; func_id < num_funcs; func_id++) {
+      if (order.num_records_of(func_id) > 0) {
+        order.funcs.push_back(func_id);
+      }
+    }
+  }
+
+  /// @brief Write the reports of the i-th function of order.funcs
+  template <typename WriteValues>
+  void write_func(JsonWriter &w, const RecordOrder &order, size_t i,
+                  bool ndjson, WriteValues &write_values) const {
+    uint32_t func_id = order.funcs[i];
+    uint32_t s = func_id % NUM_SHARDS, local = func_id / NUM_SHARDS;
+    const Shard &shard = *shards[s];
+    if (ndjson) {
+      w.put('{');
+    } else {
+      w.write(i == 0 ? "[{" : ",{", 2);
+    }
+    w.string(shard.names[local]);
+    w.write(":[", 2);
+    const ValuePool &pool = shard.table.values();
+    const std::vector<uint32_t> &first = order.first[s];
+    for (uint32_t j = first[local]; j < first[local + 1]; j++) {
+      uint32_t r = order.order[s][j];
+      if (j > first[local]) {
+        w.put(',');
+      }
+      w.put('[');
+      write_values(w, pool, func_id, false, shard.table.inputs_of(r));
+      w.write(",[", 2);
+      uint32_t o = order.pending_only ? shard.table.num_flushed(r) : 0;
+      for (uint32_t begin = o; o < shard.table.num_outputs(r); o++) {
+        if (o > begin) {
+          w.put(',');
+        }
+        write_values(w, pool, func_id, true, shard.table.output_of(r, o));
+      }
+      w.write("]]", 2);
+    }
+    w.write(ndjson ? "]}\n" : "]}");
+  }
+
+  void write_end(JsonWriter &w, const RecordOrder &order, bool ndjson) const {
+    if (!ndjson) {
+      w.write(order.funcs.empty() ? "null" : "]");
+    }
+  }
+
+  /**
+   * @brief Write sorted records to a file, formatting on threads
+   * @details the functions are split into chunks of about the same number
+   * of records, which are formatted in parallel and written in order, see
+   * write_chunks
+   */
+  template <typename WriteValues>
+  bool write_sorted(int fd, const RecordOrder &order, bool ndjson,
+                    unsigned num_threads, WriteValues &write_values) const {
+    // chunk k holds the functions order.funcs[bounds[k], bounds[k + 1])
+    size_t num_records = 0;
+    for (uint32_t func_id : order.funcs) {
+      num_records += order.num_records_of(func_id);
+    }
+    size_t chunk_records = num_records / (std::max(num_threads, 1u) * 8);
+    if (chunk_records < MIN_CHUNK_RECORDS) {
+      chunk_records = MIN_CHUNK_RECORDS;
+    }
+    std::vector<size_t> bounds(1, 0);
+    size_t records = 0;
+    for (size_t i = 0; i < order.funcs.size(); i++) {
+      records += order.num_records_of(order.funcs[i]);
+      if (records >= chunk_records || i + 1 == order.funcs.size()) {
+        bounds.push_back(i + 1);
+        records = 0;
+      }
+    }
+    size_t num_chunks = bounds.size() - 1;
+
+    if (num_threads <= 1 || num_chunks <= 1) {
+      JsonWriter w(fd);
+      for (size_t i = 0; i < order.funcs.size(); i++) {
+        write_func(w, order, i, ndjson, write_values);
+      }
+      write_end(w, order, ndjson);
+      return w.flush();
+    }
+    return write_chunks(fd, num_chunks, num_threads,
+                        [&](size_t k, JsonWriter &w) {
+                          for (size_t i = bounds[k]; i < bounds[k + 1]; i++) {
+                            write_func(w, order, i, ndjson, write_values);
+                          }
+                          if (k + 1 == num_chunks) {
+                            write_end(w, order, ndjson);
+                          }
+                        });
+  }
 
 public:
-  ReportTable() : max_outputs_for_input(5) {}
+  ReportTable() : ReportTable(5) {}
 
   /**
    * @brief Construct a new Report Table object
    * @param cap the capacity of the value vector and report table
    */
-  ReportTable(int cap) : max_outputs_for_input(cap) {}
+  ReportTable(int cap) {
+    for (uint32_t i = 0; i < NUM_SHARDS; i++) {
+      shards.emplace_back(new Shard(cap));
+    }
+  }
 
   /**
    * @brief Report the input and output of a function to report_table
+   * @details see ExecHashMap::insert, the values are only stored for new
+   * observations
+   * @param func_id: ID of the function
    * @param func_name: name of the function
-   * @param io: a pair inputs and outputs of the function
+   * @return number of distinct inputs reported for the function so far
    */
-  void report(const std::string &func_name, IOPair &io) {
-    if (table.find(func_name) == table.end()) {
-      // only report the first 10 executions of the same function
-      // ToDo: decide a better upper limit
-      auto exec_hash_map = ExecHashMap(max_outputs_for_input);
-      exec_hash_map.insert(io);
-      table.insert({func_name, exec_hash_map});
-    } else {
-      table[func_name].insert(io);
+  template <typename MakeInputs, typename MakeOutputs>
+  int report(uint32_t func_id, const std::string &func_name,
+             uint64_t input_hash, uint64_t output_hash,
+             MakeInputs make_inputs, MakeOutputs make_outputs) {
+    Shard &shard = shard_of(func_id);
+    uint32_t local = func_id / NUM_SHARDS;
+    std::lock_guard<std::mutex> guard(shard.lock);
+    bool inserted = shard.table.insert(func_id, input_hash, output_hash,
+                                       make_inputs, make_outputs);
+    if (local >= shard.names.size()) {
+      shard.names.resize(local + 1);
+      shard.inputs_per_func.resize(local + 1, 0);
     }
+    if (inserted) {
+      shard.names[local] = func_name;
+      shard.inputs_per_func[local]++;
+    }
+    return shard.inputs_per_func[local];
   }
 
-  nlohmann::json to_json() const {
-    nlohmann::json j;
-    for (auto &kv : table) {
-      const std::string &file_and_func_name = kv.first;
-      const ExecHashMap &exec_hash_map = kv.second;
-      j += nlohmann::json{{file_and_func_name, exec_hash_map.to_json()}};
+  /**
+   * @brief Look up the inputs of a call without reporting it
+   * @return number of distinct inputs reported for the function so far, or
+   * 0 if these inputs were not reported for it yet
+   */
+  int known_inputs(uint32_t func_id, uint64_t input_hash) {
+    Shard &shard = shard_of(func_id);
+    uint32_t local = func_id / NUM_SHARDS;
+    std::lock_guard<std::mutex> guard(shard.lock);
+    if (!shard.table.contains(func_id, input_hash)) {
+      return 0;
+    }
+    return shard.inputs_per_func[local];
+  }
+
+  /**
+   * @brief Write all reports as JSON, grouped by function in ID order
+   * @details [{"<function_name>": [[inputs, [outputs, ...]], ...]}, ...] as
+   * nlohmann::json::dump would write it, or with ndjson one
+   * {"<function_name>": [...]} object per line. The records are written
+   * straight from the shards, nothing but their order is built in memory.
+   * @param fd: file to write to, at its current position
+   * @param num_threads: number of threads formatting the records
+   * @param write_values: callable (JsonWriter &, const ValuePool &, func_id,
+   * is_rnt, StoredValues) writing stored values as an array of strings
+   * @return false if writing failed
+   */
+  template <typename WriteValues>
+  bool write_json(int fd, bool ndjson, unsigned num_threads,
+                  WriteValues write_values) {
+    std::vector<std::unique_lock<std::mutex>> guards = lock_all();
+    RecordOrder order;
+    order.pending_only = false;
+    sort_records(order);
+    return write_sorted(fd, order, ndjson, num_threads, write_values);
+  }
+
+  /**
+   * @brief Write the outputs reported since the last flush as NDJSON
+   * @details every line holds a function and its new outputs with their
+   * inputs, a function or inputs appear again on later lines if they get
+   * new outputs. The written values are released afterwards, the table
+   * only keeps the hashes needed to not report an observation twice.
+   * @param fd: file to append to, at its current position
+   * @return false if writing failed
+   */
+  template <typename WriteValues>
+  bool flush_json(int fd, unsigned num_threads, WriteValues write_values) {
+    std::vector<std::unique_lock<std::mutex>> guards = lock_all();
+    RecordOrder order;
+    order.pending_only = true;
+    sort_records(order);
+    if (!write_sorted(fd, order, true, num_threads, write_values)) {
+      return false;
+    }
+    for (std::unique_ptr<Shard> &shard : shards) {
+      shard->table.release_flushed();
+    }
+    return true;
+  }
+
+  /**
+   * @brief Remove all reports, releasing their memory in bulk
+   */
+  void clear() {
+    for (std::unique_ptr<Shard> &shard : shards) {
+      std::lock_guard<std::mutex> guard(shard->lock);
+      shard->table.clear();
+      shard->names.clear();
+      shard->inputs_per_func.clear();
     }
-    return j;
   }
 };
 
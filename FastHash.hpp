@@ -0,0 +1,57 @@
+#ifndef FAST_HASH_HPP
+#define FAST_HASH_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief 64-bit hashing of raw captured values
+ * @details a small wyhash-style hash: 8 bytes are consumed per step and
+ * folded in with one 64x64->128 bit multiply, so hashing a call's arguments
+ * costs a few multiplies and no allocation.
+ * https://github.com/wangyi-fudan/wyhash
+ */
+
+static const uint64_t FAST_HASH_P0 = 0xa0761d6478bd642full;
+static const uint64_t FAST_HASH_P1 = 0xe7037ed1a0b428dbull;
+static const uint64_t FAST_HASH_P2 = 0x8ebc6af09c88c6e3ull;
+
+static inline uint64_t fast_hash_mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+/**
+ * @brief Fold a 64-bit value into a hash
+ * @param h: hash so far, 0 to start a new hash
+ * @param v: value to add
+ */
+static inline uint64_t fast_hash_u64(uint64_t h, uint64_t v) {
+  return fast_hash_mix(h ^ FAST_HASH_P0, v ^ FAST_HASH_P1);
+}
+
+/**
+ * @brief Fold a byte range into a hash
+ * @param h: hash so far, 0 to start a new hash
+ * @param data: bytes to add
+ * @param len: number of bytes
+ */
+static inline uint64_t fast_hash_bytes(uint64_t h, const void *data,
+                                       size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+  h = fast_hash_u64(h, len ^ FAST_HASH_P2);
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    h = fast_hash_u64(h, v);
+  }
+  if (len > 0) {
+    uint64_t v = 0;
+    memcpy(&v, p, len);
+    h = fast_hash_u64(h, v);
+  }
+  return h;
+}
+
+#endif // FAST_HASH_HPP
@@ -0,0 +1,274 @@
+#ifndef JSON_WRITER_HPP
+#define JSON_WRITER_HPP
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Writes JSON text to a file descriptor through a large buffer
+ * @details the caller writes the structure with put() and the strings with
+ * string(), which escapes them like nlohmann::json::dump does, so the report
+ * is streamed to the file without building a DOM or the whole text first.
+ * A writer without a file keeps the text in memory, see write_chunks.
+ */
+class JsonWriter {
+private:
+  static const size_t BUFFER_SIZE = 1 << 20;
+
+  int fd;
+  std::vector<char> buffer;
+  size_t len;
+  bool failed;
+
+  /// @brief Make room for n more bytes
+  void reserve(size_t n) {
+    if (len + n <= buffer.size()) {
+      return;
+    }
+    if (fd >= 0) {
+      flush();
+      if (n <= buffer.size()) {
+        return;
+      }
+    }
+    buffer.resize(std::max(buffer.size() * 2, len + n));
+  }
+
+public:
+  explicit JsonWriter(int fd)
+      : fd(fd), buffer(BUFFER_SIZE), len(0), failed(false) {}
+  /// @brief A writer keeping the text in memory
+  JsonWriter() : fd(-1), buffer(BUFFER_SIZE / 16), len(0), failed(false) {}
+  JsonWriter(const JsonWriter &) = delete;
+  JsonWriter &operator=(const JsonWriter &) = delete;
+  ~JsonWriter() { flush(); }
+
+  /**
+   * @brief Write the buffered text to the file
+   * @return false if a write failed, now or before
+   */
+  bool flush() {
+    if (fd < 0) {
+      return true;
+    }
+    size_t done = 0;
+    while (!failed && done < len) {
+      ssize_t n = ::write(fd, buffer.data() + done, len - done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        failed = true;
+        break;
+      }
+      done += n;
+    }
+    len = 0;
+    return !failed;
+  }
+
+  void put(char c) {
+    reserve(1);
+    buffer[len++] = c;
+  }
+
+  /// @brief Write raw JSON text
+  void write(const char *s, size_t n) {
+    reserve(n);
+    memcpy(buffer.data() + len, s, n);
+    len += n;
+  }
+
+  void write(const char *s) { write(s, strlen(s)); }
+
+  /// @brief Write a quoted and escaped JSON string
+  void string(const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    put('"');
+    size_t start = 0;
+    for (size_t i = 0; i < n; i++) {
+      unsigned char c = s[i];
+      if (c >= 0x20 && c != '"' && c != '\\') {
+        continue;
+      }
+      write(s + start, i - start);
+      start = i + 1;
+      switch (c) {
+      case '"':
+        write("\\\"", 2);
+        break;
+      case '\\':
+        write("\\\\", 2);
+        break;
+      case '\b':
+        write("\\b", 2);
+        break;
+      case '\f':
+        write("\\f", 2);
+        break;
+      case '\n':
+        write("\\n", 2);
+        break;
+      case '\r':
+        write("\\r", 2);
+        break;
+      case '\t':
+        write("\\t", 2);
+        break;
+      default: {
+        char esc[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+        write(esc, sizeof(esc));
+      }
+      }
+    }
+    write(s + start, n - start);
+    put('"');
+  }
+
+  void string(const std::string &s) { string(s.data(), s.size()); }
+
+  /// @brief Write an array of strings
+  void strings(const std::vector<std::string> &vs) {
+    put('[');
+    for (size_t i = 0; i < vs.size(); i++) {
+      if (i > 0) {
+        put(',');
+      }
+      string(vs[i]);
+    }
+    put(']');
+  }
+
+  /// @brief Text of a writer without a file
+  const char *data() const { return buffer.data(); }
+  size_t size() const { return len; }
+};
+
+/**
+ * @brief Write all of iov at offset, advancing offset
+ */
+static inline bool pwritev_all(int fd, struct iovec *iov, int cnt,
+                               off_t &offset) {
+  for (;;) {
+    while (cnt > 0 && iov->iov_len == 0) {
+      iov++;
+      cnt--;
+    }
+    if (cnt == 0) {
+      return true;
+    }
+    ssize_t n = pwritev(fd, iov, cnt, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    offset += n;
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/**
+ * @brief Format the chunks of a file on threads and write them in order
+ * @details workers format chunks into memory, the calling thread writes
+ * finished chunks with pwritev once all chunks before them are written.
+ * Workers do not run more than 2 * num_threads chunks ahead of the written
+ * ones, which bounds the memory held at once.
+ * @param fd: file to write to, at its current position
+ * @param num_chunks: number of chunks
+ * @param num_threads: number of worker threads
+ * @param format: callable (chunk, JsonWriter &) formatting a chunk
+ * @return false if writing failed
+ */
+template <typename Format>
+bool write_chunks(int fd, size_t num_chunks, unsigned num_threads,
+                  Format format) {
+  const size_t window = 2 * num_threads;
+  std::vector<std::unique_ptr<JsonWriter>> done(num_chunks);
+  std::mutex lock;
+  std::condition_variable cv;
+  size_t next = 0, written = 0;
+  bool failed = false;
+
+  auto worker = [&] {
+    for (;;) {
+      size_t k;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [&] {
+          return failed || next >= num_chunks || next < written + window;
+        });
+        if (failed || next >= num_chunks) {
+          return;
+        }
+        k = next++;
+      }
+      std::unique_ptr<JsonWriter> out(new JsonWriter());
+      format(k, *out);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        done[k] = std::move(out);
+      }
+      cv.notify_all();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < num_threads; t++) {
+    workers.emplace_back(worker);
+  }
+
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  std::vector<std::unique_ptr<JsonWriter>> batch;
+  std::vector<struct iovec> iov;
+  while (written < num_chunks && !failed) {
+    batch.clear();
+    {
+      // write all finished chunks that follow the written ones at once
+      std::unique_lock<std::mutex> guard(lock);
+      cv.wait(guard, [&] { return done[written] != nullptr; });
+      for (size_t k = written;
+           k < num_chunks && done[k] && batch.size() < IOV_MAX; k++) {
+        batch.push_back(std::move(done[k]));
+      }
+    }
+    iov.clear();
+    for (std::unique_ptr<JsonWriter> &out : batch) {
+      iov.push_back(iovec{(void *)out->data(), out->size()});
+    }
+    bool ok = pwritev_all(fd, iov.data(), iov.size(), offset);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      written += batch.size();
+      failed = !ok;
+    }
+    cv.notify_all();
+  }
+  for (std::thread &t : workers) {
+    t.join();
+  }
+  lseek(fd, offset, SEEK_SET);
+  return !failed;
+}
+
+#endif // JSON_WRITER_HPP
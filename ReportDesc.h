@@ -0,0 +1,122 @@
+#ifndef REPORT_DESC_H
+#define REPORT_DESC_H
+
+#include <stdint.h>
+
+/**
+ * @brief Layout shared by the Report pass and the reporter runtime
+ * @details The pass emits one ReportFuncDesc per instrumented function into
+ * REPORT_DESC_SECTION, and a constructor that hands the section bounds to
+ * `report_register_descs`. The runtime assigns each descriptor a dense
+ * function ID, instrumented calls only pass that ID and the runtime looks
+ * everything else up in the tables it decoded once at registration.
+ */
+
+/// section the pass places the function descriptors in, the linker
+/// concatenates them into one table per executable or shared library
+#define REPORT_DESC_SECTION "report_desc"
+#define REPORT_DESC_VERSION 3
+
+/// ID of a descriptor that has not been registered yet, the runtime ignores
+/// calls with out of range IDs
+#define REPORT_ID_UNREGISTERED 0xffffffffu
+
+/// ReportFuncDesc::flags, the instrumentation skips reporting a call if any
+/// flag is set when the call enters the function
+#define REPORT_FLAG_SATURATED 0x1u // report budget of the function is used up
+#define REPORT_FLAG_DISABLED 0x2u  // capture is disabled, see report_set_enabled
+
+/// ReportFuncDesc::props, properties of a function found by the pass
+// outputs only depend on the reported inputs, so they are only captured the
+// first time the inputs are seen
+#define REPORT_PROP_DETERMINISTIC 0x1u
+// hot in the profile the pass was given, only every REPORT_SAMPLE_PERIOD-th
+// call is captured
+#define REPORT_PROP_SAMPLED 0x2u
+
+enum ReportTypeKind {
+  RTK_Unknown = 0,
+  RTK_Int,        // iN
+  RTK_Float,      // half, bfloat, float
+  RTK_Double,     // double
+  RTK_FP128,      // fp128
+  RTK_LongDouble, // x86_fp80, ppc_fp128
+  RTK_Void,       // only valid as a pointer base type
+  RTK_Func,       // function (pointer)
+  RTK_Struct,     // struct passed by value
+};
+
+/**
+ * @brief Encoded type tag of a reported value
+ * @details bits [0, 8) kind, [8, 16) pointer level, [16, 32) bit width of the
+ * (pointer base) type, e.g. i32** is {RTK_Int, 2, 32}
+ */
+typedef uint32_t ReportTypeTag;
+
+static inline ReportTypeTag report_make_tag(unsigned kind, unsigned ptr_level,
+                                            unsigned bits) {
+  return (kind & 0xff) | ((ptr_level & 0xff) << 8) | ((bits & 0xffff) << 16);
+}
+static inline unsigned report_tag_kind(ReportTypeTag tag) { return tag & 0xff; }
+static inline unsigned report_tag_ptr_level(ReportTypeTag tag) {
+  return (tag >> 8) & 0xff;
+}
+static inline unsigned report_tag_bits(ReportTypeTag tag) { return tag >> 16; }
+
+/**
+ * @brief Field of a struct layout
+ * @details fields of nested structs are flattened into the outer layout
+ */
+struct ReportFieldDesc {
+  uint32_t offset; // in bytes from the start of the struct
+  ReportTypeTag tag;
+  // layout of the pointee of a pointer to a struct, null otherwise
+  const struct ReportTypeLayout *layout;
+};
+
+/**
+ * @brief Layout of a struct type, emitted by the pass for reported pointers
+ * to structs
+ * @details lets the runtime copy the pointee and follow its pointer fields,
+ * see REPORT_CAPTURE_DEPTH
+ */
+struct ReportTypeLayout {
+  const char *name; // e.g. %struct.LinkedNode
+  uint32_t size;    // alloc size in bytes
+  uint32_t num_fields;
+  const struct ReportFieldDesc *fields;
+};
+
+struct ReportFuncDesc {
+  const char *name;             // file?func
+  const ReportTypeTag *in_tags; // one tag per reported input
+  const ReportTypeTag *out_tags;
+  // ">>=" terminated LLVM type names, only used to name unsupported types
+  const char *in_types;
+  const char *out_types;
+  uint32_t num_in;
+  uint32_t num_out;
+  uint32_t id; // set by the runtime at registration
+  uint32_t flags;
+  // layout of the pointee of each reported value, null if it is not a
+  // struct, or null if no value has one
+  const struct ReportTypeLayout *const *in_layouts;
+  const struct ReportTypeLayout *const *out_layouts;
+  uint32_t props;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @brief Enable or disable capture at runtime
+ * @details sets or clears REPORT_FLAG_DISABLED of every registered
+ * descriptor, calls entering a function while capture is disabled only cost
+ * the flag check. Capture cannot be enabled if SILENT_REPORTER is set.
+ */
+void report_set_enabled(int enabled);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // REPORT_DESC_H
@@ -0,0 +1,173 @@
+#ifndef SAFE_READ_HPP
+#define SAFE_READ_HPP
+
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+
+/**
+ * @brief Reads of memory that may not be mapped, without faulting
+ * @details Reported pointers can be dangling or garbage. A read first looks
+ * up the pages it touches in a cache of pages known to be readable, a hit is
+ * a plain memcpy. A miss reads with process_vm_readv, which fails with
+ * EFAULT instead of faulting, and caches the pages on success. munmap,
+ * mremap and mprotect are interposed to drop the pages they change from the
+ * cache.
+ *
+ * Memory the libc unmaps internally, e.g. a large block passed to free, is
+ * not seen by the interposition, so cached reads still run under a SIGSEGV
+ * and SIGBUS handler installed once. It only jumps back if the faulting
+ * thread is inside a cached read and otherwise forwards the signal to the
+ * handler installed before it. Where process_vm_readv is not available, e.g.
+ * under qemu-user, every read takes the guarded path.
+ */
+
+namespace safe_read {
+
+static const unsigned PAGE_BITS = 12;
+static const size_t CACHE_SIZE = 4096; // pages, a power of two
+
+/// page number + 1 of each slot, 0 if the slot is empty
+static std::atomic<uintptr_t> page_cache[CACHE_SIZE];
+
+// the checks run concurrently with other threads' reads, a stale hit is
+// caught by the fault handler
+inline std::atomic<uintptr_t> &cache_slot(uintptr_t page) {
+  return page_cache[(page ^ (page >> 12)) & (CACHE_SIZE - 1)];
+}
+
+inline bool page_cached(uintptr_t page) {
+  return cache_slot(page).load(std::memory_order_relaxed) == page + 1;
+}
+
+inline void cache_pages(uintptr_t first, uintptr_t last) {
+  for (uintptr_t page = first; page <= last; page++) {
+    cache_slot(page).store(page + 1, std::memory_order_relaxed);
+  }
+}
+
+/// @brief Drop the pages of a range from the cache
+inline void invalidate(const void *addr, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  uintptr_t first = (uintptr_t)addr >> PAGE_BITS;
+  uintptr_t last = ((uintptr_t)addr + len - 1) >> PAGE_BITS;
+  if (last - first >= CACHE_SIZE) {
+    for (size_t i = 0; i < CACHE_SIZE; i++) {
+      page_cache[i].store(0, std::memory_order_relaxed);
+    }
+    return;
+  }
+  for (uintptr_t page = first; page <= last; page++) {
+    uintptr_t expected = page + 1;
+    cache_slot(page).compare_exchange_strong(expected, 0,
+                                             std::memory_order_relaxed);
+  }
+}
+
+/// jump buffer of the guarded read the thread is in, null outside of one
+static thread_local sigjmp_buf *fault_env;
+static struct sigaction prev_segv, prev_bus;
+
+inline void fault_handler(int sig, siginfo_t *info, void *ctx) {
+  if (sigjmp_buf *env = fault_env) {
+    fault_env = nullptr;
+    siglongjmp(*env, 1);
+  }
+
+  // not a fault of ours
+  struct sigaction &prev = sig == SIGSEGV ? prev_segv : prev_bus;
+  if (prev.sa_flags & SA_SIGINFO) {
+    prev.sa_sigaction(sig, info, ctx);
+  } else if (prev.sa_handler == SIG_DFL || prev.sa_handler == SIG_IGN) {
+    // the faulting instruction runs again with the previous disposition
+    sigaction(sig, &prev, nullptr);
+  } else {
+    prev.sa_handler(sig);
+  }
+}
+
+/// @brief Install the fault handler, once per process
+inline void install_fault_handler() {
+  static bool installed = [] {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = fault_handler;
+    sigemptyset(&sa.sa_mask);
+    // the handler jumps out without restoring the signal mask,
+    // so the signal must not be blocked while it runs
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+    sigaction(SIGSEGV, &sa, &prev_segv);
+    sigaction(SIGBUS, &sa, &prev_bus);
+    return true;
+  }();
+  (void)installed;
+}
+
+/// @brief memcpy that returns false instead of faulting
+inline bool guarded_copy(void *dst, const void *src, size_t len) {
+  install_fault_handler();
+  sigjmp_buf env;
+  // no signal mask is saved, so this does not make a syscall
+  if (sigsetjmp(env, 0) != 0) {
+    return false;
+  }
+  fault_env = &env;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  memcpy(dst, src, len);
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  fault_env = nullptr;
+  return true;
+}
+
+/// set once process_vm_readv turned out to be unavailable
+static std::atomic<bool> no_vm_readv(false);
+
+/**
+ * @brief Copy len bytes from src if they are readable
+ * @return false if some byte of [src, src + len) is not readable
+ */
+inline bool read(void *dst, const void *src, size_t len) {
+  if (len == 0) {
+    return true;
+  }
+  uintptr_t first = (uintptr_t)src >> PAGE_BITS;
+  uintptr_t last = ((uintptr_t)src + len - 1) >> PAGE_BITS;
+  if (page_cached(first) && (last == first || page_cached(last))) {
+    return guarded_copy(dst, src, len);
+  }
+
+  if (!no_vm_readv.load(std::memory_order_relaxed)) {
+    struct iovec local = {dst, len};
+    struct iovec remote = {const_cast<void *>(src), len};
+    ssize_t n = syscall(SYS_process_vm_readv, getpid(), &local, 1UL, &remote,
+                        1UL, 0UL);
+    if (n == (ssize_t)len) {
+      cache_pages(first, last);
+      return true;
+    }
+    if (n >= 0 || errno == EFAULT) {
+      return false;
+    }
+    // e.g. ENOSYS under qemu-user or EPERM in a sandbox
+    no_vm_readv.store(true, std::memory_order_relaxed);
+  }
+  return guarded_copy(dst, src, len);
+}
+
+/// @brief Read a value of type T from src if it is readable
+template <typename T> bool read_value(T &val, const void *src) {
+  return read(&val, src, sizeof(T));
+}
+
+} // namespace safe_read
+
+#endif // SAFE_READ_HPP
@@ -0,0 +1,566 @@
+#ifndef SHARED_TABLE_HPP
+#define SHARED_TABLE_HPP
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "FastHash.hpp"
+#include "JsonWriter.hpp"
+
+/**
+ * @brief Report table in a memory region shared by several processes
+ * @details the region is either shared memory or a file, which keeps the
+ * table across runs. It holds a header, three open-addressing tables of
+ * fixed capacity (functions, inputs and outputs) and an arena holding the
+ * names and the formatted values. Entries are claimed by setting their key
+ * with a compare-and-swap and their data is published by setting the arena
+ * offset of their values last, so processes insert concurrently without
+ * locks and a process killed in the middle of an insert leaves at most an
+ * entry without values, which is not written to the report.
+ *
+ * The report is written by the last process leaving the region, as the
+ * process that created it may be a fork server or a job scheduler that never
+ * reports nor exits normally. Processes killed without leaving are told
+ * apart by their pid being gone.
+ */
+
+#define SHARED_TABLE_MAGIC "RPTTABLE"
+#define SHARED_TABLE_VERSION 2
+
+// processes the region tracks at once, see SharedTable::join
+#define SHARED_TABLE_MAX_PROCS 1024
+
+struct SharedTableHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  // size of the whole region
+  uint64_t size;
+  // number of entries of each table, powers of two
+  uint32_t num_funcs;
+  uint32_t num_inputs;
+  uint32_t num_outputs;
+  // maximum number of outputs kept for the same inputs
+  uint32_t max_outputs;
+  // offsets of the tables and the arena from the start of the region
+  uint64_t funcs_offset;
+  uint64_t inputs_offset;
+  uint64_t outputs_offset;
+  uint64_t arena_offset;
+  // bytes of the arena handed out
+  std::atomic<uint64_t> arena_used;
+  // observations dropped because the region was full
+  std::atomic<uint64_t> dropped;
+  // process writing the report, 0 if none is
+  std::atomic<int32_t> writer;
+  // set once the header is initialized
+  std::atomic<uint32_t> ready;
+  // number of values published so far
+  std::atomic<uint64_t> generation;
+  // generation the report was last written at
+  std::atomic<uint64_t> written;
+  // processes that reported to the region and did not leave it, 0 for a
+  // free slot. Slots of processes that died are reused.
+  std::atomic<int32_t> procs[SHARED_TABLE_MAX_PROCS];
+};
+
+/// @brief A function, keyed by the hash of its name
+struct SharedFunc {
+  std::atomic<uint64_t> key;
+  // arena offset of the name, 0 until it is written
+  std::atomic<uint64_t> name;
+  uint32_t name_len;
+  // ID of the function in the process that added it, orders the report
+  uint32_t func_id;
+  std::atomic<uint32_t> num_inputs;
+  // SHARED_FUNC_* flags
+  std::atomic<uint32_t> flags;
+};
+
+// the function used up its report budget in some process
+#define SHARED_FUNC_SATURATED 1u
+
+/// @brief Inputs of a function, keyed by the function and the input hash
+struct SharedInput {
+  std::atomic<uint64_t> key;
+  // arena offset of the inputs as a JSON array, 0 until they are written
+  std::atomic<uint64_t> values;
+  uint32_t values_len;
+  // index of the function
+  uint32_t func;
+  std::atomic<uint32_t> num_outputs;
+  uint32_t reserved;
+};
+
+/// @brief Outputs for some inputs, keyed by the inputs and the output hash
+struct SharedOutput {
+  std::atomic<uint64_t> key;
+  // arena offset of the outputs as a JSON array, 0 until they are written
+  std::atomic<uint64_t> values;
+  uint32_t values_len;
+  // index of the inputs
+  uint32_t input;
+};
+
+class SharedTable {
+private:
+  static const uint32_t NUM_FUNCS = 1 << 16;
+  // bytes of formatted values expected per observation
+  static const uint64_t ARENA_PER_OBSERVATION = 128;
+
+  char *base;
+  size_t size;
+  SharedTableHeader *header;
+  SharedFunc *funcs;
+  SharedInput *inputs;
+  SharedOutput *outputs;
+
+  static uint32_t round_up_pow2(uint64_t n) {
+    uint32_t p = 1;
+    while (p < n && p < (1u << 31)) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  /// @brief 0 marks free entries
+  static uint64_t entry_key(uint64_t h) { return h ? h : 1; }
+
+  /**
+   * @brief Find the entry of a key, claiming a free one if it is missing
+   * @param inserted: set if the entry was claimed by this call
+   * @return the entry, or null if the table is full
+   */
+  template <typename Entry>
+  static Entry *claim(Entry *entries, uint32_t n, uint64_t key,
+                      bool &inserted) {
+    inserted = false;
+    for (uint32_t i = 0; i < n; i++) {
+      Entry &e = entries[(key + i) & (n - 1)];
+      uint64_t cur = e.key.load(std::memory_order_acquire);
+      if (cur == 0 &&
+          e.key.compare_exchange_strong(cur, key, std::memory_order_acq_rel)) {
+        inserted = true;
+        return &e;
+      }
+      if (cur == key) {
+        return &e;
+      }
+    }
+    return nullptr;
+  }
+
+  /// @brief Find the entry of a key without claiming one
+  template <typename Entry>
+  static Entry *find(Entry *entries, uint32_t n, uint64_t key) {
+    for (uint32_t i = 0; i < n; i++) {
+      Entry &e = entries[(key + i) & (n - 1)];
+      uint64_t cur = e.key.load(std::memory_order_acquire);
+      if (cur == 0) {
+        return nullptr;
+      }
+      if (cur == key) {
+        return &e;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief Copy bytes to the arena
+   * @return their offset in the region, or 0 if the arena is full
+   */
+  uint64_t store(const char *data, size_t len) {
+    uint64_t arena_size = header->size - header->arena_offset;
+    uint64_t aligned = (len + 7) & ~(uint64_t)7;
+    uint64_t at = header->arena_used.load(std::memory_order_relaxed);
+    // only hand out the bytes if they fit, smaller values may still fit
+    // after a larger one did not
+    do {
+      if (at + aligned > arena_size) {
+        return 0;
+      }
+    } while (!header->arena_used.compare_exchange_weak(
+        at, at + aligned, std::memory_order_relaxed));
+    memcpy(base + header->arena_offset + at, data, len);
+    return header->arena_offset + at;
+  }
+
+  /// @brief Store formatted values and publish them in an entry
+  template <typename Entry> bool publish(Entry &e, const JsonWriter &w) {
+    uint64_t at = store(w.data(), w.size());
+    if (!at) {
+      return false;
+    }
+    e.values_len = w.size();
+    e.values.store(at, std::memory_order_release);
+    header->generation.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  void drop() { header->dropped.fetch_add(1, std::memory_order_relaxed); }
+
+  bool map(int fd, size_t map_size) {
+    void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   0);
+    if (p == MAP_FAILED) {
+      return false;
+    }
+    base = (char *)p;
+    size = map_size;
+    header = (SharedTableHeader *)base;
+    return true;
+  }
+
+  static bool is_alive(int32_t pid) {
+    return pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+  }
+
+  void locate_tables() {
+    funcs = (SharedFunc *)(base + header->funcs_offset);
+    inputs = (SharedInput *)(base + header->inputs_offset);
+    outputs = (SharedOutput *)(base + header->outputs_offset);
+  }
+
+public:
+  SharedTable()
+      : base(nullptr), size(0), header(nullptr), funcs(nullptr),
+        inputs(nullptr), outputs(nullptr) {}
+  SharedTable(const SharedTable &) = delete;
+  SharedTable &operator=(const SharedTable &) = delete;
+  ~SharedTable() {
+    if (base) {
+      munmap(base, size);
+    }
+  }
+
+  /**
+   * @brief Size and lay out a new region in an empty file and map it
+   * @param fd: file of the region, opened for reading and writing
+   * @param capacity: number of observations the region should hold
+   * @param max_outputs: maximum number of outputs kept for the same inputs
+   * @return false if the region could not be created
+   */
+  bool create(int fd, uint64_t capacity, uint32_t max_outputs) {
+    SharedTableHeader h;
+    memset((void *)&h, 0, sizeof(h));
+    memcpy(h.magic, SHARED_TABLE_MAGIC, sizeof(h.magic));
+    h.version = SHARED_TABLE_VERSION;
+    h.header_size = sizeof(SharedTableHeader);
+    // keep the tables at most half full
+    h.num_funcs = NUM_FUNCS;
+    h.num_inputs = round_up_pow2(capacity * 2);
+    h.num_outputs = round_up_pow2(capacity * 2);
+    h.max_outputs = max_outputs;
+    h.funcs_offset = (sizeof(h) + 63) & ~(uint64_t)63;
+    h.inputs_offset = h.funcs_offset + (uint64_t)h.num_funcs * sizeof(SharedFunc);
+    h.outputs_offset =
+        h.inputs_offset + (uint64_t)h.num_inputs * sizeof(SharedInput);
+    h.arena_offset =
+        h.outputs_offset + (uint64_t)h.num_outputs * sizeof(SharedOutput);
+    h.size = h.arena_offset + capacity * ARENA_PER_OBSERVATION;
+    if (ftruncate(fd, h.size) != 0 || !map(fd, h.size)) {
+      return false;
+    }
+    // the file is zero-filled, which leaves every entry free
+    memcpy((void *)header, &h, sizeof(h));
+    header->ready.store(1, std::memory_order_release);
+    locate_tables();
+    return true;
+  }
+
+  /**
+   * @brief Map a region created by another process or an earlier run
+   * @details waits for its creator to finish laying it out
+   * @return an error message, or null if the region can be used
+   */
+  const char *attach(int fd) {
+    struct stat st;
+    for (int tries = 0;; tries++) {
+      if (fstat(fd, &st) != 0) {
+        return "cannot stat shared report";
+      }
+      if ((size_t)st.st_size >= sizeof(SharedTableHeader)) {
+        break;
+      }
+      if (tries == 1000) {
+        return "shared report is not initialized";
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (!map(fd, st.st_size)) {
+      return "cannot map shared report";
+    }
+    for (int tries = 0; !header->ready.load(std::memory_order_acquire);
+         tries++) {
+      if (tries == 1000) {
+        return "shared report is not initialized";
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (memcmp(header->magic, SHARED_TABLE_MAGIC, sizeof(header->magic)) !=
+            0 ||
+        header->version != SHARED_TABLE_VERSION ||
+        header->header_size != sizeof(SharedTableHeader) ||
+        header->size > size) {
+      return "not a shared report of this reporter";
+    }
+    locate_tables();
+    return nullptr;
+  }
+
+  /**
+   * @brief Count this process among the ones reporting to the region
+   * @details called before its first report, a process that never reports
+   * does not hold back the report of the others
+   * @return false if all slots are taken by live processes
+   */
+  bool join() {
+    int32_t pid = getpid();
+    for (std::atomic<int32_t> &slot : header->procs) {
+      int32_t cur = slot.load(std::memory_order_relaxed);
+      if (cur == pid) {
+        return true;
+      }
+      if (!is_alive(cur) && slot.compare_exchange_strong(cur, pid)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// @brief Stop counting this process, see join
+  void leave() {
+    int32_t pid = getpid();
+    for (std::atomic<int32_t> &slot : header->procs) {
+      int32_t cur = pid;
+      slot.compare_exchange_strong(cur, 0);
+    }
+  }
+
+  /// @brief Whether a process that joined the region is still running
+  bool others_alive() const {
+    for (const std::atomic<int32_t> &slot : header->procs) {
+      if (is_alive(slot.load(std::memory_order_relaxed))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @brief Start writing the report unless another process is writing it
+   * or it is up to date
+   * @param generation: set to the state of the region the report shows
+   * @return false if this process should not write the report
+   */
+  bool begin_write(uint64_t &generation) {
+    int32_t cur = header->writer.load(std::memory_order_relaxed);
+    if (is_alive(cur) ||
+        !header->writer.compare_exchange_strong(cur, getpid())) {
+      return false;
+    }
+    generation = header->generation.load(std::memory_order_acquire);
+    if (generation == header->written.load(std::memory_order_relaxed) &&
+        generation != 0) {
+      header->writer.store(0, std::memory_order_release);
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief Finish writing the report and write the region back to its file
+   * @return whether values were published while the report was written and
+   * no process is left to write them
+   */
+  bool end_write(uint64_t generation) {
+    header->written.store(generation, std::memory_order_relaxed);
+    msync(base, size, MS_SYNC);
+    header->writer.store(0, std::memory_order_seq_cst);
+    return header->generation.load(std::memory_order_seq_cst) != generation &&
+           !others_alive();
+  }
+
+  uint64_t dropped() const {
+    return header->dropped.load(std::memory_order_relaxed);
+  }
+
+  /// @brief Number of observations the region was created for
+  uint64_t capacity() const {
+    return (header->size - header->arena_offset) / ARENA_PER_OBSERVATION;
+  }
+
+  /// @brief Maximum number of outputs kept for the same inputs
+  uint32_t max_outputs() const { return header->max_outputs; }
+
+  /**
+   * @brief Get the entry of a function, adding it if it is missing
+   * @details the name is stored before the entry is claimed, so an entry
+   * never stays without a name when the arena is full. If another process
+   * claims the entry first, the stored name is left unused.
+   * @param func_id: ID of the function in this process
+   * @return the entry, or null if the region is full
+   */
+  SharedFunc *func(uint32_t func_id, const std::string &name) {
+    uint64_t key = entry_key(fast_hash_bytes(0, name.data(), name.size()));
+    if (SharedFunc *f = find(funcs, header->num_funcs, key)) {
+      return f;
+    }
+    uint64_t at = store(name.data(), name.size());
+    if (!at) {
+      return nullptr;
+    }
+    bool inserted;
+    SharedFunc *f = claim(funcs, header->num_funcs, key, inserted);
+    if (f && inserted) {
+      f->name_len = name.size();
+      f->func_id = func_id;
+      f->name.store(at, std::memory_order_release);
+    }
+    return f;
+  }
+
+  /**
+   * @brief Report the input and output of a function unless they were
+   * reported before, by any process
+   * @param func: entry of the function, see func()
+   * @param make_inputs: callable (JsonWriter &) writing the inputs as a JSON
+   * array, only called for new inputs
+   * @param make_outputs: callable (JsonWriter &) writing the outputs, only
+   * called for new outputs
+   * @return number of distinct inputs reported for the function so far
+   */
+  template <typename MakeInputs, typename MakeOutputs>
+  int report(SharedFunc &func, uint64_t input_hash, uint64_t output_hash,
+             MakeInputs make_inputs, MakeOutputs make_outputs) {
+    uint64_t in_key = entry_key(fast_hash_u64(func.key, input_hash));
+    bool inserted;
+    SharedInput *in = claim(inputs, header->num_inputs, in_key, inserted);
+    if (!in) {
+      drop();
+      return func.num_inputs.load(std::memory_order_relaxed);
+    }
+    if (inserted) {
+      JsonWriter w;
+      make_inputs(w);
+      in->func = &func - funcs;
+      if (!publish(*in, w)) {
+        drop();
+      }
+      func.num_inputs.fetch_add(1, std::memory_order_relaxed);
+    }
+    int num_inputs = func.num_inputs.load(std::memory_order_relaxed);
+
+    uint64_t out_key = entry_key(fast_hash_u64(in_key, output_hash));
+    if (find(outputs, header->num_outputs, out_key)) {
+      return num_inputs;
+    }
+    // reserve a place among the outputs of the inputs
+    if (in->num_outputs.fetch_add(1, std::memory_order_relaxed) >=
+        header->max_outputs) {
+      in->num_outputs.fetch_sub(1, std::memory_order_relaxed);
+      return num_inputs;
+    }
+    SharedOutput *out = claim(outputs, header->num_outputs, out_key, inserted);
+    if (!out || !inserted) {
+      in->num_outputs.fetch_sub(1, std::memory_order_relaxed);
+      if (!out) {
+        drop();
+      }
+      return num_inputs;
+    }
+    JsonWriter w;
+    make_outputs(w);
+    out->input = in - inputs;
+    if (!publish(*out, w)) {
+      drop();
+    }
+    return num_inputs;
+  }
+
+  /**
+   * @brief Write the reports of all processes as JSON
+   * @details in the format of ReportTable::write_json, functions ordered by
+   * ID and their inputs and outputs in the order they were reported.
+   * Entries whose values were never written are left out.
+   * @param fd: file to write to, at its current position
+   * @return false if writing failed
+   */
+  bool write_json(int fd, bool ndjson) const {
+    // the outputs to write, grouped by function and inputs
+    std::vector<uint32_t> order;
+    for (uint32_t o = 0; o < header->num_outputs; o++) {
+      const SharedOutput &out = outputs[o];
+      if (!out.values.load(std::memory_order_acquire)) {
+        continue;
+      }
+      const SharedInput &in = inputs[out.input];
+      if (in.values.load(std::memory_order_acquire) &&
+          funcs[in.func].name.load(std::memory_order_acquire)) {
+        order.push_back(o);
+      }
+    }
+    auto sort_key = [&](uint32_t o) {
+      const SharedInput &in = inputs[outputs[o].input];
+      const SharedFunc &func = funcs[in.func];
+      return std::make_tuple(func.func_id, func.key.load(), in.values.load(),
+                             outputs[o].values.load());
+    };
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+      return sort_key(a) < sort_key(b);
+    });
+
+    JsonWriter w(fd);
+    auto text = [&](uint64_t at, uint32_t len) { w.write(base + at, len); };
+    uint32_t prev_func = UINT32_MAX, prev_input = UINT32_MAX;
+    for (size_t i = 0; i < order.size(); i++) {
+      const SharedOutput &out = outputs[order[i]];
+      const SharedInput &in = inputs[out.input];
+      if (in.func != prev_func) {
+        if (prev_func != UINT32_MAX) {
+          w.write(ndjson ? "]]]}\n" : "]]]}");
+        }
+        if (!ndjson) {
+          w.put(prev_func == UINT32_MAX ? '[' : ',');
+        }
+        const SharedFunc &func = funcs[in.func];
+        w.put('{');
+        w.string(base + func.name.load(), func.name_len);
+        w.write(":[[", 3);
+        text(in.values.load(), in.values_len);
+        w.write(",[", 2);
+      } else if (out.input != prev_input) {
+        w.write("]],[", 4);
+        text(in.values.load(), in.values_len);
+        w.write(",[", 2);
+      } else {
+        w.put(',');
+      }
+      text(out.values.load(), out.values_len);
+      prev_func = in.func;
+      prev_input = out.input;
+    }
+    if (prev_func != UINT32_MAX) {
+      w.write(ndjson ? "]]]}\n" : "]]]}]");
+    } else if (!ndjson) {
+      w.write("null");
+    }
+    return w.flush();
+  }
+};
+
+#endif // SHARED_TABLE_HPP
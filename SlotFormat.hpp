@@ -0,0 +1,447 @@
+#ifndef SLOT_FORMAT_HPP
+#define SLOT_FORMAT_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "ReportDesc.h"
+
+/**
+ * @brief Decoding and formatting of reported values
+ * @details shared by the reporter and the tools reading its binary traces,
+ * a value is captured once (SlotCapture) and formatted to the strings of the
+ * report by the SlotFormatter selected for its decoded type (SlotInfo).
+ */
+
+typedef std::vector<std::string> IOVector;
+
+inline std::vector<std::string> parse_meta(std::string meta) {
+  std::vector<std::string> xs;
+  std::string delimiter = ">>=";
+
+  size_t pos = 0;
+  std::string token;
+  // TODO: substr is also expensive.
+  while ((pos = meta.find(delimiter)) != std::string::npos) {
+    token = meta.substr(0, pos);
+    xs.push_back(token);
+    meta.erase(0, pos + delimiter.length());
+  }
+  return xs;
+}
+
+enum CaptureState : uint8_t {
+  CAPTURE_VALUE,      // raw value, and for pointers a copy of the referent
+  CAPTURE_NULL,       // null pointer
+  CAPTURE_INNER_NULL, // multi-level pointer to a null pointer
+  CAPTURE_FAULT,      // referent could not be read
+};
+
+/// @brief State of a node of a deep capture, followed by the node's bytes
+/// for DEEP_NODE
+enum DeepNodeState : uint8_t {
+  DEEP_NODE,  // copy of the pointee
+  DEEP_NULL,  // null pointer
+  DEEP_CYCLE, // pointee was already captured by the same value
+  DEEP_CUT,   // depth or byte budget of the capture is used up
+  DEEP_FAULT, // pointee could not be read
+};
+
+/**
+ * @brief A reported value as it was at the time of the call
+ * @details values are captured and hashed first, and only formatted to
+ * strings if the observation they belong to was not reported before
+ */
+struct SlotCapture {
+  uint64_t raw;
+  CaptureState state;
+  // deep capture of a pointer to a struct: deep_len bytes at deep_offset
+  // from this capture, the nodes of the pointer graph in depth-first order
+  // as DeepNodeState and the node's bytes. Captures are stored and copied
+  // together with the bytes following them.
+  uint32_t deep_offset;
+  uint32_t deep_len;
+  // copy of the referent of a pointer, at most a long double
+  alignas(16) unsigned char referent[16];
+
+  const unsigned char *deep() const {
+    return (const unsigned char *)this + deep_offset;
+  }
+};
+
+struct SlotInfo;
+/// @brief Converts a captured value to a string
+typedef std::string (*SlotFormatter)(const SlotCapture &c,
+                                     const SlotInfo &slot);
+
+/**
+ * @brief Type of a reported value decoded from its ReportTypeTag
+ */
+struct SlotInfo {
+  unsigned kind;
+  unsigned bits;
+  unsigned ptr_level;
+  // type name without pointer levels, e.g. %struct.LinkedNode
+  std::string base_type;
+  // bytes of the referent captured for pointers
+  unsigned referent_size;
+  // layout of the pointee of a pointer to a struct, only available in the
+  // instrumented process
+  const ReportTypeLayout *layout;
+  // selected once at registration from kind and ptr_level
+  SlotFormatter format;
+};
+
+/**
+ * todo: support struct
+ * https://llvm.org/docs/LangRef.html#structure-type
+ * @brief Check if a type is a struct
+ * @param type: type to check
+ * @return true if the type is a struct
+ */
+inline bool is_struct(const SlotInfo &slot) { return false; }
+
+/**
+ * @brief Convert a single-level reference pointer to a string of its referent
+ * @param ptr: pointer to the referent casted to void*
+ * @param slot: decoded type of the pointer
+ * @return string representation of the referent
+ */
+inline std::string to_string_ptr(void *ptr, const SlotInfo &slot) {
+  if (!ptr) {
+    return std::string("ptr[]");
+  }
+  std::string val;
+
+  if (slot.kind == RTK_Void) {
+    return "ptr[]: void";
+  } else if (slot.kind == RTK_Int) {
+    // * Integer Type
+    if (slot.bits <= 32) {
+      val = std::to_string(*(int *)ptr);
+    } else {
+      val = std::to_string(*(long *)ptr);
+    }
+  } else if (slot.kind == RTK_Float) {
+    // * Floating-Point Types
+    val = std::to_string(*(float *)ptr);
+  } else if (slot.kind == RTK_Double) {
+    val = std::to_string(*(double *)ptr);
+  } else if (slot.kind == RTK_FP128 || slot.kind == RTK_LongDouble) {
+    val = std::to_string(*(long double *)ptr);
+  } else {
+    // add type name to error message
+    // todo: support these common types
+    return "ptr[]: " + slot.base_type;
+  }
+  return val;
+}
+
+/**
+ * @brief Size of the node a deep capture copies for a pointer field
+ * @return 0 if the field is not followed
+ */
+inline unsigned field_node_size(const ReportFieldDesc &field) {
+  if (report_tag_ptr_level(field.tag) != 1) {
+    return 0;
+  }
+  if (field.layout) {
+    return field.layout->size;
+  }
+  switch (report_tag_kind(field.tag)) {
+  case RTK_Int: {
+    unsigned bits = report_tag_bits(field.tag);
+    return bits <= 8 ? 1 : bits <= 16 ? 2 : bits <= 32 ? 4 : 8;
+  }
+  case RTK_Float:
+    return sizeof(float);
+  case RTK_Double:
+    return sizeof(double);
+  case RTK_FP128:
+  case RTK_LongDouble:
+    return sizeof(long double);
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Format a scalar of the given tag stored at p, which may be unaligned
+ */
+inline std::string format_scalar(const unsigned char *p, ReportTypeTag tag) {
+  unsigned bits = report_tag_bits(tag);
+  switch (report_tag_kind(tag)) {
+  case RTK_Int: {
+    if (bits == 1) {
+      return std::to_string(*p & 1);
+    }
+    unsigned bytes = bits <= 8 ? 1 : bits <= 16 ? 2 : bits <= 32 ? 4 : 8;
+    int64_t v = 0;
+    memcpy(&v, p, bytes);
+    // sign-extend from the integer's width
+    int shift = 64 - bytes * 8;
+    return std::to_string((int64_t)((uint64_t)v << shift) >> shift);
+  }
+  case RTK_Float: {
+    float f;
+    memcpy(&f, p, sizeof(f));
+    return std::to_string(f);
+  }
+  case RTK_Double: {
+    double d;
+    memcpy(&d, p, sizeof(d));
+    return std::to_string(d);
+  }
+  case RTK_FP128:
+  case RTK_LongDouble: {
+    long double d;
+    memcpy(&d, p, sizeof(d));
+    return std::to_string(d);
+  }
+  default:
+    return "?";
+  }
+}
+
+/**
+ * @brief Format the node of a deep capture at p and its children
+ * @param p: position in the capture, advanced past the node
+ * @param end: end of the capture
+ * @param layout: layout of the node, null for a scalar node
+ * @param tag: tag of the field pointing to the node
+ * @return e.g. {0, ptr[{1, ptr[]}]} for a list of two nodes
+ */
+inline std::string format_deep(const unsigned char *&p,
+                               const unsigned char *end,
+                               const ReportTypeLayout *layout,
+                               ReportTypeTag tag) {
+  if (p >= end) {
+    return "ptr[...]";
+  }
+  switch (*p++) {
+  case DEEP_NULL:
+    return "ptr[]";
+  case DEEP_CYCLE:
+    return "ptr[cycle]";
+  case DEEP_CUT:
+    return "ptr[...]";
+  case DEEP_FAULT:
+    return "ptr[]: pointer already freed";
+  default:
+    break;
+  }
+
+  // a capture read from a trace may be cut short
+  const unsigned char *node = p;
+  if (!layout) {
+    unsigned size = field_node_size(ReportFieldDesc{0, tag, nullptr});
+    if ((size_t)(end - p) < size) {
+      return "ptr[...]";
+    }
+    p += size;
+    return format_scalar(node, report_make_tag(report_tag_kind(tag), 0,
+                                               report_tag_bits(tag)));
+  }
+  if ((size_t)(end - p) < layout->size) {
+    return "ptr[...]";
+  }
+  p += layout->size;
+
+  std::string val = "{";
+  for (uint32_t i = 0; i < layout->num_fields; i++) {
+    const ReportFieldDesc &field = layout->fields[i];
+    if (i > 0) {
+      val += ", ";
+    }
+    if (report_tag_ptr_level(field.tag) == 0) {
+      val += format_scalar(node + field.offset, field.tag);
+    } else if (field_node_size(field) == 0) {
+      val += "ptr";
+    } else {
+      std::string child = format_deep(p, end, field.layout, field.tag);
+      val += child.compare(0, 4, "ptr[") == 0 ? child : "ptr[" + child + "]";
+    }
+  }
+  return val + "}";
+}
+
+/**
+ * @brief Reinterpret the raw bits of a slot
+ * @details the pass stores integers zero-extended, pointers as integers,
+ * and floating-point values converted to double
+ */
+template <typename T> T slot_cast(uint64_t raw) {
+  T val;
+  memcpy(&val, &raw, sizeof(T));
+  return val;
+}
+
+template <typename T> uint64_t to_slot(T val) {
+  uint64_t raw = 0;
+  memcpy(&raw, &val, sizeof(T));
+  return raw;
+}
+
+/**
+ * @brief Format a non-pointer value of the given kind
+ */
+template <unsigned Kind>
+std::string format_value(const SlotCapture &c, const SlotInfo &slot) {
+  // other types just use type as input encoding
+  return "Unknown Type Value";
+}
+
+template <>
+inline std::string format_value<RTK_Int>(const SlotCapture &c,
+                                         const SlotInfo &slot) {
+  // * Integer Type
+  uint64_t raw = c.raw;
+  if (slot.bits == 1) {
+    return std::to_string(raw & 1);
+  }
+  if (slot.bits <= 32) {
+    // sign-extend from the integer's width
+    int shift = 32 - slot.bits;
+    return std::to_string((int32_t)((uint32_t)raw << shift) >> shift);
+  }
+  return std::to_string((long)raw);
+}
+
+template <>
+inline std::string format_value<RTK_Double>(const SlotCapture &c,
+                                            const SlotInfo &slot) {
+  // * Floating-Point Types
+  return std::to_string(slot_cast<double>(c.raw));
+}
+
+template <>
+inline std::string format_value<RTK_Func>(const SlotCapture &c,
+                                          const SlotInfo &slot) {
+  // * Function Type
+  return "func_pointer";
+}
+
+template <>
+inline std::string format_value<RTK_Struct>(const SlotCapture &c,
+                                            const SlotInfo &slot) {
+  // * Struct Type
+  // todo: decode as the type of  first element
+  return "a struct";
+}
+
+/**
+ * @brief Format the captured referent of a pointer
+ */
+inline std::string format_pointer(const SlotCapture &c, const SlotInfo &slot) {
+  // * Pointer Type
+  // i32**: base_type = i32, ptr_level = 2
+  switch (c.state) {
+  case CAPTURE_NULL:
+    return "ptr[]";
+  case CAPTURE_FAULT:
+    return "ptr[]: pointer already freed";
+  case CAPTURE_INNER_NULL:
+    return "ptr[ptr[]]";
+  default:
+    break;
+  }
+
+  std::string val;
+  if (slot.layout && c.deep_len > 0) {
+    const unsigned char *p = c.deep();
+    val = format_deep(p, p + c.deep_len, slot.layout, 0);
+  } else {
+    val = to_string_ptr((void *)c.referent, slot);
+  }
+  return slot.ptr_level == 1 ? val : "ptr[" + val + "]";
+}
+
+/**
+ * @brief Size of the referent to_string_ptr reads for a pointer
+ */
+inline unsigned referent_size(const SlotInfo &slot) {
+  switch (slot.kind) {
+  case RTK_Int:
+    return slot.bits <= 32 ? sizeof(int) : sizeof(long);
+  case RTK_Float:
+    return sizeof(float);
+  case RTK_Double:
+    return sizeof(double);
+  case RTK_FP128:
+  case RTK_LongDouble:
+    return sizeof(long double);
+  default:
+    // only the type name is reported
+    return 0;
+  }
+}
+
+inline SlotFormatter select_formatter(const SlotInfo &slot) {
+  if (slot.kind == RTK_Func) {
+    return format_value<RTK_Func>;
+  }
+  if (slot.ptr_level > 0) {
+    return format_pointer;
+  }
+  if (is_struct(slot)) {
+    return format_value<RTK_Struct>;
+  }
+
+  switch (slot.kind) {
+  case RTK_Int:
+    return format_value<RTK_Int>;
+  case RTK_Float:
+  case RTK_Double:
+  case RTK_FP128:
+  case RTK_LongDouble:
+    // all floating-point values are passed as double
+    return format_value<RTK_Double>;
+  default:
+    return format_value<RTK_Unknown>;
+  }
+}
+
+/**
+ * @param layouts: pointee layouts of the values, see ReportFuncDesc, null in
+ * tools that only read traces
+ */
+inline std::vector<SlotInfo>
+decode_slots(const ReportTypeTag *tags, uint32_t len, const char *type_names,
+             const ReportTypeLayout *const *layouts = nullptr) {
+  std::vector<std::string> types;
+  if (type_names) {
+    types = parse_meta(std::string(type_names));
+  }
+
+  std::vector<SlotInfo> slots;
+  for (uint32_t i = 0; i < len; i++) {
+    SlotInfo slot;
+    slot.kind = report_tag_kind(tags[i]);
+    slot.bits = report_tag_bits(tags[i]);
+    slot.ptr_level = report_tag_ptr_level(tags[i]);
+    if (i < types.size()) {
+      std::string &type = types[i];
+      slot.base_type = type.substr(0, type.find('*'));
+    }
+    slot.referent_size = slot.ptr_level > 0 ? referent_size(slot) : 0;
+    slot.layout = layouts ? layouts[i] : nullptr;
+    slot.format = select_formatter(slot);
+    slots.push_back(slot);
+  }
+  return slots;
+}
+
+inline IOVector format_captures(const SlotCapture *captures,
+                                const std::vector<SlotInfo> &types) {
+  IOVector vs;
+  vs.reserve(types.size());
+  for (size_t i = 0; i < types.size(); i++) {
+    vs.push_back(types[i].format(captures[i], types[i]));
+  }
+  return vs;
+}
+
+#endif // SLOT_FORMAT_HPP
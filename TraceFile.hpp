@@ -0,0 +1,504 @@
+#ifndef TRACE_FILE_HPP
+#define TRACE_FILE_HPP
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "SlotFormat.hpp"
+
+/**
+ * @brief Binary trace of the observations reported by a run
+ * @details a trace is a TraceHeader followed by records, each starting with
+ * a TraceRecord and padded to a multiple of 8 bytes. The type of a record is
+ * written last, so a trace cut short by a crash ends at the first record of
+ * type TRACE_END (zero). Values are stored as SlotCaptures and decoded with
+ * the types of their function's TRACE_FUNC record, see SlotFormat.hpp.
+ * Deep captures are stored behind the captures and decoded with the struct
+ * layouts of TRACE_LAYOUT records.
+ */
+
+#define TRACE_MAGIC "RPTTRACE"
+#define TRACE_VERSION 2
+
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  // offset of the first record
+  uint32_t header_size;
+  // sizeof(SlotCapture) of the writer
+  uint32_t capture_size;
+  uint32_t reserved;
+};
+
+enum TraceRecordType : uint32_t {
+  TRACE_END = 0,
+  TRACE_FUNC,   // TraceFunc, tags, layout IDs, name, in_types, out_types
+  TRACE_INPUT,  // TraceValues, SlotCapture[num_values], deep captures
+  TRACE_OUTPUT, // TraceValues, SlotCapture[num_values], deep captures
+  TRACE_LAYOUT, // TraceLayout, TraceField[num_fields], name
+};
+
+struct TraceRecord {
+  uint32_t type;
+  // size of the whole record, including this header and padding
+  uint32_t size;
+};
+
+/**
+ * @brief A function, followed by num_in + num_out type tags, as many IDs of
+ * the layouts of their pointees (0 if a value does not point to a struct)
+ * and the strings
+ */
+struct TraceFunc {
+  uint32_t func_id;
+  uint32_t num_in;
+  uint32_t num_out;
+  uint32_t name_len;
+  uint32_t in_types_len;
+  uint32_t out_types_len;
+};
+
+/// @brief A struct layout, see ReportTypeLayout
+struct TraceLayout {
+  // unique in the trace, from 1
+  uint32_t layout_id;
+  uint32_t size;
+  uint32_t num_fields;
+  uint32_t name_len;
+};
+
+/// @brief A field of a TraceLayout, see ReportFieldDesc
+struct TraceField {
+  uint32_t offset;
+  ReportTypeTag tag;
+  // layout of the pointee, 0 if the field does not point to a struct
+  uint32_t layout_id;
+};
+
+/**
+ * @brief Values of a new observation, followed by the captures
+ * @details the same inputs or observation may be traced more than once
+ */
+struct TraceValues {
+  uint32_t func_id;
+  uint32_t num_values;
+  // hash of the function and the inputs the values belong to, the same for
+  // all TRACE_INPUT records of the inputs
+  uint64_t input_ref;
+  // hash of the values, the same for values that print the same
+  uint64_t hash;
+};
+
+/**
+ * @brief Appends records to a trace file through a memory-mapped window
+ * @details only a window of WINDOW_SIZE bytes around the end of the trace is
+ * mapped. The data is written to the shared mapping, so it is in the page
+ * cache and survives the process even if it is killed before exiting.
+ */
+class TraceWriter {
+private:
+  static const size_t WINDOW_SIZE = 4 << 20;
+
+  int fd;
+  char *window;
+  size_t window_start;
+  size_t window_size;
+  // end of the last record
+  size_t pos;
+  std::mutex lock;
+
+  /**
+   * @brief Get the address of the next size bytes of the trace, moving the
+   * window if needed
+   */
+  char *reserve(size_t size) {
+    if (window && pos + size <= window_start + window_size) {
+      return window + (pos - window_start);
+    }
+    if (window) {
+      munmap(window, window_size);
+      window = nullptr;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    window_start = pos & ~(page - 1);
+    size_t needed = (pos + size - window_start + page - 1) & ~(page - 1);
+    window_size = needed > WINDOW_SIZE ? needed : WINDOW_SIZE;
+    if (ftruncate(fd, window_start + window_size) != 0) {
+      return nullptr;
+    }
+    void *p = mmap(nullptr, window_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, window_start);
+    if (p == MAP_FAILED) {
+      return nullptr;
+    }
+    window = (char *)p;
+    return window + (pos - window_start);
+  }
+
+  void fail(const char *what) {
+    perror(what);
+    close_locked();
+  }
+
+  void close_locked() {
+    if (window) {
+      munmap(window, window_size);
+      window = nullptr;
+    }
+    if (fd >= 0) {
+      // drop the unused rest of the last window
+      if (ftruncate(fd, pos) != 0) {
+        perror("Error truncating trace");
+      }
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+public:
+  TraceWriter()
+      : fd(-1), window(nullptr), window_start(0), window_size(0), pos(0) {}
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+  ~TraceWriter() { close(); }
+
+  /**
+   * @brief Create the trace file and write its header
+   * @return false if the file could not be created
+   */
+  bool open(const char *path) {
+    std::lock_guard<std::mutex> guard(lock);
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror("Error opening trace");
+      return false;
+    }
+    char *p = reserve(sizeof(TraceHeader));
+    if (!p) {
+      fail("Error mapping trace");
+      return false;
+    }
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.header_size = sizeof(TraceHeader);
+    header.capture_size = sizeof(SlotCapture);
+    memcpy(p, &header, sizeof(header));
+    pos = sizeof(header);
+    return true;
+  }
+
+  bool is_open() const { return fd >= 0; }
+
+  /**
+   * @brief Append a record
+   * @param type: TraceRecordType of the record
+   * @param payload_size: number of bytes after the TraceRecord
+   * @param fill: callable writing the payload to a char*
+   */
+  template <typename Fill>
+  void append(TraceRecordType type, size_t payload_size, Fill fill) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (fd < 0) {
+      return;
+    }
+    size_t size = (sizeof(TraceRecord) + payload_size + 7) & ~(size_t)7;
+    char *p = reserve(size);
+    if (!p) {
+      fail("Error mapping trace");
+      return;
+    }
+    fill(p + sizeof(TraceRecord));
+    TraceRecord *rec = (TraceRecord *)p;
+    rec->size = size;
+    // a record only counts once its type is set
+    __atomic_store_n(&rec->type, type, __ATOMIC_RELEASE);
+    pos += size;
+  }
+
+  /// @brief Unmap the window and trim the file to the written records
+  void close() {
+    std::lock_guard<std::mutex> guard(lock);
+    close_locked();
+  }
+
+  /// @brief Keep other threads from appending while the process forks
+  void lock_for_fork() { lock.lock(); }
+
+  void unlock_after_fork() { lock.unlock(); }
+
+  /**
+   * @brief Drop the trace inherited from the parent in a forked child
+   * @details the file is left as the parent writes it, the writer is
+   * unlocked and can be opened again
+   */
+  void drop_inherited() {
+    if (window) {
+      munmap(window, window_size);
+      window = nullptr;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    pos = 0;
+    lock.unlock();
+  }
+};
+
+/**
+ * @brief Reads the records of a trace file
+ */
+class TraceReader {
+private:
+  const char *data;
+  size_t size;
+
+public:
+  TraceReader() : data(nullptr), size(0) {}
+  TraceReader(const TraceReader &) = delete;
+  TraceReader &operator=(const TraceReader &) = delete;
+  ~TraceReader() {
+    if (data) {
+      munmap((void *)data, size);
+    }
+  }
+
+  /**
+   * @brief Map a trace file and check its header
+   * @return an error message, or null if the trace can be read
+   */
+  const char *open(const char *path) {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      return "cannot open trace";
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceHeader)) {
+      ::close(fd);
+      return "not a trace";
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      return "cannot map trace";
+    }
+    data = (const char *)p;
+    size = st.st_size;
+
+    TraceHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+      return "not a trace";
+    }
+    if (header.version != TRACE_VERSION) {
+      return "unsupported trace version";
+    }
+    if (header.capture_size != sizeof(SlotCapture) ||
+        header.header_size < sizeof(header) || header.header_size > size) {
+      return "trace written by an incompatible reporter";
+    }
+    return nullptr;
+  }
+
+  /**
+   * @brief Call f(type, payload, payload_size) for every complete record
+   * @return false if the trace ends with a truncated record
+   */
+  template <typename F> bool for_each(F f) const {
+    TraceHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t pos = header.header_size;
+    while (pos + sizeof(TraceRecord) <= size) {
+      TraceRecord rec;
+      memcpy(&rec, data + pos, sizeof(rec));
+      if (rec.type == TRACE_END) {
+        return true;
+      }
+      if (rec.size < sizeof(rec) || rec.size > size - pos) {
+        return false;
+      }
+      f((TraceRecordType)rec.type, data + pos + sizeof(rec),
+        rec.size - sizeof(rec));
+      pos += rec.size;
+    }
+    return pos == size;
+  }
+};
+
+/// @brief Name and value types of a traced function
+struct TracedFunc {
+  std::string name;
+  std::vector<SlotInfo> inputs;
+  std::vector<SlotInfo> outputs;
+};
+
+/**
+ * @brief Struct layouts of a trace, by their ID
+ * @details a layout is created when it is first referred to, by a function,
+ * a field or its own TRACE_LAYOUT record, so the layouts can point to each
+ * other whatever the order of their records. A layout without a valid record
+ * has no fields.
+ */
+class TracedLayouts {
+private:
+  struct Entry {
+    ReportTypeLayout layout;
+    std::string name;
+    std::vector<ReportFieldDesc> fields;
+  };
+  // entries do not move once inserted
+  std::map<uint32_t, Entry> entries;
+
+public:
+  /// @brief Get the layout of an ID, null for 0
+  const ReportTypeLayout *get(uint32_t layout_id) {
+    if (layout_id == 0) {
+      return nullptr;
+    }
+    auto inserted = entries.emplace(layout_id, Entry());
+    Entry &e = inserted.first->second;
+    if (inserted.second) {
+      e.layout = ReportTypeLayout{"", 0, 0, nullptr};
+    }
+    return &e.layout;
+  }
+
+  /**
+   * @brief Decode the payload of a TRACE_LAYOUT record
+   * @return false if the record is malformed, e.g. a field is not within the
+   * struct
+   */
+  bool decode(const char *p, size_t size) {
+    TraceLayout tl;
+    if (size < sizeof(tl)) {
+      return false;
+    }
+    memcpy(&tl, p, sizeof(tl));
+    if (tl.layout_id == 0 ||
+        sizeof(tl) + (uint64_t)tl.num_fields * sizeof(TraceField) +
+                tl.name_len >
+            size) {
+      return false;
+    }
+    p += sizeof(tl);
+    std::vector<ReportFieldDesc> fields(tl.num_fields);
+    for (ReportFieldDesc &field : fields) {
+      TraceField tf;
+      memcpy(&tf, p, sizeof(tf));
+      p += sizeof(tf);
+      // the bytes of a scalar field are read from the node
+      unsigned bytes = 0;
+      if (report_tag_ptr_level(tf.tag) == 0) {
+        bytes = field_node_size(ReportFieldDesc{
+            0,
+            report_make_tag(report_tag_kind(tf.tag), 1,
+                            report_tag_bits(tf.tag)),
+            nullptr});
+      }
+      if ((uint64_t)tf.offset + bytes > tl.size) {
+        return false;
+      }
+      field = ReportFieldDesc{tf.offset, tf.tag, get(tf.layout_id)};
+    }
+    Entry &e = entries[tl.layout_id];
+    e.name.assign(p, tl.name_len);
+    e.fields = std::move(fields);
+    e.layout = ReportTypeLayout{e.name.c_str(), tl.size, tl.num_fields,
+                                e.fields.data()};
+    return true;
+  }
+};
+
+/**
+ * @brief Decode the payload of a TRACE_FUNC record
+ * @param size: size of the payload, the lengths it holds are checked against
+ * @param layouts: layouts of the trace the pointees of the values refer to
+ * @return false if the record is malformed
+ */
+static inline bool decode_trace_func(const char *p, size_t size, TraceFunc &tf,
+                                     TracedFunc &func,
+                                     TracedLayouts &layouts) {
+  if (size < sizeof(tf)) {
+    return false;
+  }
+  memcpy(&tf, p, sizeof(tf));
+  uint64_t num_tags = (uint64_t)tf.num_in + tf.num_out;
+  uint64_t needed = sizeof(tf) +
+                    num_tags * (sizeof(ReportTypeTag) + sizeof(uint32_t)) +
+                    tf.name_len + tf.in_types_len + tf.out_types_len;
+  if (needed > size) {
+    return false;
+  }
+  p += sizeof(tf);
+  std::vector<ReportTypeTag> tags(num_tags);
+  memcpy(tags.data(), p, tags.size() * sizeof(ReportTypeTag));
+  p += tags.size() * sizeof(ReportTypeTag);
+  std::vector<const ReportTypeLayout *> value_layouts(num_tags);
+  for (const ReportTypeLayout *&layout : value_layouts) {
+    uint32_t layout_id;
+    memcpy(&layout_id, p, sizeof(layout_id));
+    p += sizeof(layout_id);
+    layout = layouts.get(layout_id);
+  }
+  func.name.assign(p, tf.name_len);
+  p += tf.name_len;
+  std::string in_types(p, tf.in_types_len);
+  p += tf.in_types_len;
+  std::string out_types(p, tf.out_types_len);
+  func.inputs = decode_slots(tags.data(), tf.num_in, in_types.c_str(),
+                             value_layouts.data());
+  func.outputs =
+      decode_slots(tags.data() + tf.num_in, tf.num_out, out_types.c_str(),
+                   value_layouts.data() + tf.num_in);
+  return true;
+}
+
+/**
+ * @brief Decode and format the payload of a TRACE_INPUT or TRACE_OUTPUT
+ * record
+ * @param size: size of the payload
+ * @param types: types of the values, from the function's TRACE_FUNC record
+ * @return false if the record does not hold a capture for each type, or a
+ * deep capture is not within the record
+ */
+static inline bool decode_trace_values(const char *p, size_t size,
+                                       const std::vector<SlotInfo> &types,
+                                       TraceValues &tv, IOVector &values) {
+  if (size < sizeof(tv)) {
+    return false;
+  }
+  memcpy(&tv, p, sizeof(tv));
+  size_t bytes = size - sizeof(tv);
+  if (tv.num_values != types.size() ||
+      (uint64_t)tv.num_values * sizeof(SlotCapture) > bytes) {
+    return false;
+  }
+  // deep captures are addressed relative to their capture, copy them along
+  std::vector<SlotCapture> captures((bytes + sizeof(SlotCapture) - 1) /
+                                    sizeof(SlotCapture));
+  memcpy((void *)captures.data(), p + sizeof(tv), bytes);
+  for (uint32_t i = 0; i < tv.num_values; i++) {
+    const SlotCapture &c = captures[i];
+    if (c.deep_len > 0 && (uint64_t)i * sizeof(SlotCapture) + c.deep_offset +
+                                  c.deep_len >
+                              bytes) {
+      return false;
+    }
+  }
+  values = format_captures(captures.data(), types);
+  return true;
+}
+
+#endif // TRACE_FILE_HPP
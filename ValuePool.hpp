@@ -0,0 +1,179 @@
+#ifndef VALUE_POOL_HPP
+#define VALUE_POOL_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "FastHash.hpp"
+
+/**
+ * @brief A bump-pointer allocator that frees all its memory at once
+ */
+class Arena {
+private:
+  static const size_t CHUNK_SIZE = 1 << 20;
+
+  std::vector<char *> chunks;
+  char *cur;
+  size_t left;
+  size_t allocated;
+
+public:
+  Arena() : cur(nullptr), left(0), allocated(0) {}
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  ~Arena() { release(); }
+
+  /**
+   * @brief Allocate memory that lives until release()
+   * @param size: number of bytes
+   * @param align: alignment, a power of two
+   */
+  void *allocate(size_t size, size_t align) {
+    size_t pad = (align - ((uintptr_t)cur & (align - 1))) & (align - 1);
+    if (pad + size > left) {
+      size_t chunk_size = size + align > CHUNK_SIZE ? size + align : CHUNK_SIZE;
+      cur = (char *)malloc(chunk_size);
+      if (!cur) {
+        abort();
+      }
+      chunks.push_back(cur);
+      left = chunk_size;
+      allocated += chunk_size;
+      pad = (align - ((uintptr_t)cur & (align - 1))) & (align - 1);
+    }
+    void *p = cur + pad;
+    cur += pad + size;
+    left -= pad + size;
+    return p;
+  }
+
+  /// @brief Free everything allocated so far
+  void release() {
+    for (char *chunk : chunks) {
+      free(chunk);
+    }
+    chunks.clear();
+    cur = nullptr;
+    left = 0;
+    allocated = 0;
+  }
+
+  size_t bytes() const { return allocated; }
+};
+
+/// @brief An interned IOVector: [len, id_0, ..., id_{len-1}] in a ValuePool
+typedef const uint32_t *IOSpan;
+
+/**
+ * @brief Interns reported values and IOVectors into an arena
+ * @details every distinct value string is stored once and referred to by a
+ * dense ID, a stored IOVector is a span of value IDs. Values like "0" or
+ * "ptr[]" repeat across most observations and are only kept once.
+ */
+class ValuePool {
+private:
+  struct Value {
+    const char *data; // null terminated, in arena
+    uint32_t len;
+    uint64_t hash;
+  };
+
+  Arena arena;
+  std::vector<Value> values;
+  // value ID + 1 of each slot, 0 marks an empty slot
+  std::vector<uint32_t> index;
+
+  void grow() {
+    std::vector<uint32_t> bigger(index.size() * 2, 0);
+    size_t mask = bigger.size() - 1;
+    for (uint32_t id = 0; id < values.size(); id++) {
+      size_t i = values[id].hash & mask;
+      while (bigger[i]) {
+        i = (i + 1) & mask;
+      }
+      bigger[i] = id + 1;
+    }
+    index.swap(bigger);
+  }
+
+public:
+  ValuePool() : index(1024, 0) {}
+
+  /**
+   * @brief Get the ID of a value, storing it if it is new
+   */
+  uint32_t intern(const std::string &s) {
+    if ((values.size() + 1) * 2 > index.size()) {
+      grow();
+    }
+    uint64_t h = fast_hash_bytes(0, s.data(), s.size());
+    size_t mask = index.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+      if (index[i] == 0) {
+        char *data = (char *)arena.allocate(s.size() + 1, 1);
+        memcpy(data, s.c_str(), s.size() + 1);
+        values.push_back(Value{data, (uint32_t)s.size(), h});
+        index[i] = values.size();
+        return values.size() - 1;
+      }
+      const Value &v = values[index[i] - 1];
+      if (v.hash == h && v.len == s.size() && !memcmp(v.data, s.data(), v.len)) {
+        return index[i] - 1;
+      }
+    }
+  }
+
+  /**
+   * @brief Store an IOVector as a span of value IDs
+   */
+  IOSpan intern(const std::vector<std::string> &vs) {
+    uint32_t *span = (uint32_t *)arena.allocate(
+        (vs.size() + 1) * sizeof(uint32_t), alignof(uint32_t));
+    span[0] = vs.size();
+    for (size_t i = 0; i < vs.size(); i++) {
+      span[i + 1] = intern(vs[i]);
+    }
+    return span;
+  }
+
+  /**
+   * @brief Copy raw bytes into the pool, e.g. values that are not formatted
+   * to strings yet
+   */
+  const void *store(const void *data, size_t size, size_t align) {
+    void *p = arena.allocate(size, align);
+    memcpy(p, data, size);
+    return p;
+  }
+
+  const char *value(uint32_t id) const { return values[id].data; }
+  uint32_t value_len(uint32_t id) const { return values[id].len; }
+
+  /**
+   * @brief Convert a stored span back to an IOVector
+   */
+  std::vector<std::string> to_vector(IOSpan span) const {
+    std::vector<std::string> vs;
+    vs.reserve(span[0]);
+    for (uint32_t i = 1; i <= span[0]; i++) {
+      vs.emplace_back(values[span[i]].data, values[span[i]].len);
+    }
+    return vs;
+  }
+
+  /// @brief Release all values and spans at once
+  void clear() {
+    arena.release();
+    values.clear();
+    std::vector<uint32_t>(1024, 0).swap(index);
+  }
+
+  size_t bytes() const { return arena.bytes(); }
+};
+
+#endif // VALUE_POOL_HPP
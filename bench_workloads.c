@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib.h"
+
+/**
+ * @brief CPU-bound workloads timed by overhead_bench
+ * @details built once as is and once instrumented, the workload and its
+ * size are selected on the command line: bench_workloads <workload> [scale]
+ */
+
+struct LinkedNode {
+  int value;
+  struct LinkedNode *next;
+};
+
+struct Vec3 {
+  double x;
+  double y;
+  double z;
+};
+
+struct Particle {
+  struct Vec3 pos;
+  struct Vec3 vel;
+  int id;
+};
+
+/// @brief Number of factorizations of n, recursive and mostly repeated inputs
+static long run_zy(long scale) {
+  long sum = 0;
+  for (long n = 1; n <= scale; n++) {
+    sum += zy(2, n % 4096 + 1);
+  }
+  return sum;
+}
+
+struct LinkedNode *list_push(struct LinkedNode *head, int value) {
+  struct LinkedNode *node = (struct LinkedNode *)malloc(sizeof(*node));
+  node->value = value;
+  node->next = head;
+  return node;
+}
+
+int node_value(struct LinkedNode *node) { return node->value; }
+
+long list_sum(struct LinkedNode *head) {
+  long sum = 0;
+  for (struct LinkedNode *cur = head; cur; cur = cur->next) {
+    sum += node_value(cur);
+  }
+  return sum;
+}
+
+/// @brief Pointer chasing through a list, one call per node and traversal
+static long run_list(long scale) {
+  struct LinkedNode *head = NULL;
+  for (int i = 0; i < 1000; i++) {
+    head = list_push(head, i);
+  }
+  long sum = 0;
+  for (long i = 0; i < scale / 100; i++) {
+    sum += list_sum(head);
+  }
+  while (head) {
+    struct LinkedNode *next = head->next;
+    free(head);
+    head = next;
+  }
+  return sum;
+}
+
+double dot(struct Vec3 a, struct Vec3 b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+struct Vec3 scale_vec(struct Vec3 v, double f) {
+  struct Vec3 r = {v.x * f, v.y * f, v.z * f};
+  return r;
+}
+
+void step(struct Particle *p, double dt) {
+  struct Vec3 d = scale_vec(p->vel, dt);
+  p->pos.x += d.x;
+  p->pos.y += d.y;
+  p->pos.z += d.z;
+}
+
+/// @brief Structs passed by value and by pointer in a hot loop, all inputs
+/// are fresh
+static long run_struct(long scale) {
+  struct Particle ps[64];
+  for (int i = 0; i < 64; i++) {
+    struct Particle p = {{i, i * 0.5, -i}, {0.25, 0.5, i * 0.01}, i};
+    ps[i] = p;
+  }
+  double energy = 0;
+  for (long i = 0; i < scale * 10; i++) {
+    struct Particle *p = &ps[i % 64];
+    step(p, 0.01);
+    energy += dot(p->vel, p->vel);
+  }
+  return (long)energy;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s zy|list|struct [scale]\n", argv[0]);
+    return 1;
+  }
+  long scale = argc > 2 ? atol(argv[2]) : 100000;
+  long result;
+  if (strcmp(argv[1], "zy") == 0) {
+    result = run_zy(scale);
+  } else if (strcmp(argv[1], "list") == 0) {
+    result = run_list(scale);
+  } else if (strcmp(argv[1], "struct") == 0) {
+    result = run_struct(scale);
+  } else {
+    fprintf(stderr, "unknown workload %s\n", argv[1]);
+    return 1;
+  }
+  printf("%s %ld: %ld\n", argv[1], scale, result);
+  return 0;
+}
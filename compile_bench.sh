@@ -0,0 +1,95 @@
+#!/bin/bash
+
+# Time the Report pass over large generated modules.
+# usage: compile_bench.sh [pass_library] [num_functions...]
+# For every size, a module with that many functions of mixed signatures is
+# run through opt once without and once with -report, and the result is
+# printed as one JSON object per line.
+
+PASS=${1:-./libReportPass.so}
+shift
+SIZES=${@:-1000 10000 50000}
+OPT=${OPT:-opt}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# gen_module <num_functions>: a module of functions taking scalars, pointers
+# and structs, returning scalars and structs, and calling each other
+gen_module() {
+  awk -v n="$1" 'BEGIN {
+    print "%struct.Pair = type { i32, double }"
+    print "%struct.Node = type { i32, %struct.Node* }"
+    print "%struct.Big = type { i32, i32, float, float, double, double }"
+    print ""
+    for (i = 0; i < n; i++) {
+      k = i % 5
+      if (k == 0) {
+        printf "define i32 @int_%d(i32 %%a, i64 %%b) {\n", i
+        print "entry:"
+        print "  %c = trunc i64 %b to i32"
+        print "  %d = add i32 %a, %c"
+        if (i > 0) {
+          printf "  %%e = call i32 @int_%d(i32 %%d, i64 %%b)\n", i - 5
+          print "  ret i32 %e"
+        } else {
+          print "  ret i32 %d"
+        }
+      } else if (k == 1) {
+        printf "define double @float_%d(double %%a, float %%b, double* %%p) {\n", i
+        print "entry:"
+        print "  %c = fpext float %b to double"
+        print "  %d = load double, double* %p"
+        print "  %e = fmul double %a, %c"
+        print "  %f = fadd double %d, %e"
+        print "  %g = fcmp olt double %f, 0.0"
+        print "  br i1 %g, label %neg, label %pos"
+        print "neg:"
+        print "  %h = fneg double %f"
+        print "  ret double %h"
+        print "pos:"
+        print "  ret double %f"
+      } else if (k == 2) {
+        printf "define i32 @list_%d(%%struct.Node* %%n) {\n", i
+        print "entry:"
+        print "  %v = getelementptr inbounds %struct.Node, %struct.Node* %n, i32 0, i32 0"
+        print "  %x = load i32, i32* %v"
+        print "  ret i32 %x"
+      } else if (k == 3) {
+        printf "define double @big_%d(%%struct.Big* byval(%%struct.Big) align 8 %%s) {\n", i
+        print "entry:"
+        print "  %e = getelementptr inbounds %struct.Big, %struct.Big* %s, i32 0, i32 4"
+        print "  %x = load double, double* %e"
+        print "  ret double %x"
+      } else {
+        printf "define void @pair_%d(%%struct.Pair* %%out, i32** %%pp, i8* %%s) {\n", i
+        print "entry:"
+        print "  %p = load i32*, i32** %pp"
+        print "  %x = load i32, i32* %p"
+        print "  %f = getelementptr inbounds %struct.Pair, %struct.Pair* %out, i32 0, i32 0"
+        print "  store i32 %x, i32* %f"
+        print "  ret void"
+      }
+      print "}"
+      print ""
+    }
+  }'
+}
+
+# seconds <command...>: wall time of a command in seconds
+seconds() {
+  local start end
+  start=$(date +%s.%N)
+  "$@" > /dev/null || return 1
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" 'BEGIN { print e - s }'
+}
+
+for n in $SIZES; do
+  gen_module "$n" > "$TMP/module.ll"
+  base=$(seconds "$OPT" -S "$TMP/module.ll" -o "$TMP/base.ll") || exit 1
+  report=$(seconds "$OPT" -load-pass-plugin "$PASS" -passes=report -S "$TMP/module.ll" -o "$TMP/report.ll") || exit 1
+  awk -v n="$n" -v b="$base" -v r="$report" 'BEGIN {
+    printf "{\"functions\":%d,\"baseline_s\":%.3f,\"report_s\":%.3f,", n, b, r
+    printf "\"pass_us_per_function\":%.2f}\n", (r - b) * 1e6 / n
+  }'
+done
@@ -0,0 +1,204 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// for convenience
+using namespace std;
+
+/**
+ * @brief Reporter settings an instrumented workload is run with
+ */
+struct Setting {
+  const char *name;
+  // NAME=value pairs added to the environment
+  vector<string> env;
+};
+
+/**
+ * @brief Cost of one run of a workload
+ */
+struct RunResult {
+  bool ok;
+  double seconds;
+  // peak resident set size in KiB
+  long max_rss;
+  // size of the dumped report, 0 if there is none
+  long long dump_bytes;
+};
+
+/**
+ * @brief Run a workload binary and measure it
+ * @details the environment of the benchmark is passed on, without the
+ * reporter variables that are not part of the setting
+ * @param binary: bench_workloads, plain or instrumented
+ * @param workload: workload to run, see bench_workloads.c
+ * @param scale: size of the workload
+ * @param env: NAME=value pairs to set
+ * @param dump_file: DUMP_FILE_NAME of the run
+ */
+static RunResult run(const char *binary, const char *workload, long scale,
+                     const vector<string> &env, const string &dump_file) {
+  RunResult result = {false, 0, 0, 0};
+  unlink(dump_file.c_str());
+  string scale_arg = to_string(scale);
+
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return result;
+  }
+  if (pid == 0) {
+    for (const char *var :
+         {"SILENT_REPORTER", "MAX_REPORT_SIZE", "MAX_REPORT_INPUTS",
+          "MAX_REPORT_CALLS", "REPORT_TRACE", "REPORT_SHM", "REPORT_DB",
+          "REPORT_FLUSH_INTERVAL", "REPORT_FLUSH_OBSERVATIONS"}) {
+      unsetenv(var);
+    }
+    setenv("DUMP_FILE_NAME", dump_file.c_str(), 1);
+    for (const string &e : env) {
+      putenv(strdup(e.c_str()));
+    }
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    execl(binary, binary, workload, scale_arg.c_str(), (char *)nullptr);
+    perror(binary);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) {
+    perror("wait4");
+    return result;
+  }
+  auto end = std::chrono::steady_clock::now();
+  result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  result.seconds = std::chrono::duration<double>(end - start).count();
+  result.max_rss = usage.ru_maxrss;
+  struct stat st;
+  if (stat(dump_file.c_str(), &st) == 0) {
+    result.dump_bytes = st.st_size;
+  }
+  unlink(dump_file.c_str());
+  return result;
+}
+
+/**
+ * @brief Run a workload repeats times and keep the fastest run
+ */
+static RunResult best_of(int repeats, const char *binary, const char *workload,
+                         long scale, const vector<string> &env,
+                         const string &dump_file) {
+  RunResult best = {false, 0, 0, 0};
+  for (int r = 0; r < repeats; r++) {
+    RunResult res = run(binary, workload, scale, env, dump_file);
+    if (!res.ok) {
+      return res;
+    }
+    if (!best.ok || res.seconds < best.seconds) {
+      best = res;
+    }
+  }
+  return best;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-r repeats] [-s scale] [-w workload]... plain_binary "
+          "instrumented_binary\n",
+          argv0);
+}
+
+/**
+ * @brief Compare the workloads of bench_workloads built with and without
+ * the Report pass
+ * @details every workload runs as is and instrumented under several
+ * reporter settings, each result is printed as one JSON object per line
+ * with the slowdown against the plain build, the peak RSS and the size of
+ * the dumped report
+ */
+int main(int argc, char **argv) {
+  int repeats = 3;
+  long scale = 100000;
+  vector<const char *> workloads;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:s:w:")) != -1) {
+    switch (opt) {
+    case 'r':
+      repeats = std::max(atoi(optarg), 1);
+      break;
+    case 's':
+      scale = std::max(atol(optarg), 1L);
+      break;
+    case 'w':
+      workloads.push_back(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *plain = argv[optind];
+  const char *instrumented = argv[optind + 1];
+  if (workloads.empty()) {
+    workloads = {"zy", "list", "struct"};
+  }
+  const vector<Setting> settings = {
+      {"silent", {"SILENT_REPORTER=1"}},
+      {"max_report_size_1", {"MAX_REPORT_SIZE=1"}},
+      {"max_report_size_10", {"MAX_REPORT_SIZE=10"}},
+      {"max_report_size_100", {"MAX_REPORT_SIZE=100"}},
+      {"max_report_inputs_100", {"MAX_REPORT_INPUTS=100"}},
+  };
+  string dump_file =
+      "/tmp/overhead_bench." + to_string(getpid()) + ".json";
+
+  bool failed = false;
+  for (const char *workload : workloads) {
+    RunResult base = best_of(repeats, plain, workload, scale, {}, dump_file);
+    if (!base.ok) {
+      fprintf(stderr, "%s %s failed\n", plain, workload);
+      failed = true;
+      continue;
+    }
+    printf("{\"workload\":\"%s\",\"scale\":%ld,\"setting\":\"plain\","
+           "\"seconds\":%.4f,\"slowdown\":1.00,\"max_rss_kb\":%ld,"
+           "\"dump_bytes\":0}\n",
+           workload, scale, base.seconds, base.max_rss);
+    fflush(stdout);
+    for (const Setting &setting : settings) {
+      RunResult res = best_of(repeats, instrumented, workload, scale,
+                              setting.env, dump_file);
+      if (!res.ok) {
+        fprintf(stderr, "%s %s failed with %s\n", instrumented, workload,
+                setting.name);
+        failed = true;
+        continue;
+      }
+      printf("{\"workload\":\"%s\",\"scale\":%ld,\"setting\":\"%s\","
+             "\"seconds\":%.4f,\"slowdown\":%.2f,\"max_rss_kb\":%ld,"
+             "\"dump_bytes\":%lld}\n",
+             workload, scale, setting.name, res.seconds,
+             res.seconds / std::max(base.seconds, 1e-9), res.max_rss,
+             res.dump_bytes);
+      fflush(stdout);
+    }
+  }
+  return failed ? 1 : 0;
+}
@@ -1,54 +1,170 @@
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/IR/Type.h"
 #include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/ProfileData/SampleProfReader.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
+#include <algorithm>
 #include <cxxabi.h>
+#include <map>
 #include <signal.h>
 #include <stdlib.h>
 #include <string>
 #include <tuple>
 #include <vector>
+
+#include "../ReportDesc.h"
 using namespace llvm;
 
 #define DEBUG_TYPE "report"
 STATISTIC(ReportCounter, "Counts number of functions executed");
+STATISTIC(NumTrivialIO, "Functions not instrumented as their I/O is trivial");
+STATISTIC(NumDeterministic, "Functions reported as deterministic");
+STATISTIC(NumFiltered, "Functions not instrumented by -report-filter");
+STATISTIC(NumHot, "Functions above -report-hot-count");
+
+static cl::opt<std::string>
+    ReportFilter("report-filter",
+                 cl::desc("File of glob patterns selecting the functions to "
+                          "instrument, see README"),
+                 cl::value_desc("filename"));
+static cl::opt<std::string> ReportProfile(
+    "report-profile",
+    cl::desc("Instrumentation (indexed, text or raw) or sample profile the "
+             "hot functions are found in"),
+    cl::value_desc("filename"));
+static cl::opt<uint64_t> ReportHotCount(
+    "report-hot-count", cl::init(1000000),
+    cl::desc("Functions entered more often than this in the profile are hot"));
+
+/// what is done with the hot functions
+enum HotAction { HotSkip, HotSample };
+static cl::opt<HotAction> ReportHot(
+    "report-hot", cl::init(HotSkip),
+    cl::desc("What to do with the hot functions"),
+    cl::values(clEnumValN(HotSkip, "skip", "do not instrument them"),
+               clEnumValN(HotSample, "sample",
+                          "only capture every REPORT_SAMPLE_PERIOD-th call")));
 
 namespace {
-struct ReportPass : public FunctionPass {
+/**
+ * @brief Descriptor of an instrumented function
+ * @details collected while instrumenting and emitted as a ReportFuncDesc
+ */
+struct FuncDescInfo {
+  std::string Name;
+  std::vector<ReportTypeTag> InTags;
+  std::vector<ReportTypeTag> OutTags;
+  std::string InTypes;
+  std::string OutTypes;
+  // pointee layouts of the reported values, null if not a struct
+  std::vector<Constant *> InLayouts;
+  std::vector<Constant *> OutLayouts;
+  uint32_t Props = 0; // REPORT_PROP_*
+};
+
+/**
+ * @brief Constants shared by the instrumented functions of a module
+ * @details strings, tag arrays, type names and runtime hooks are created
+ * once per module and reused by every function that needs them, so the cost
+ * of the pass stays linear in the size of the module
+ */
+struct ModuleCache {
+  StringMap<Constant *> Strings;
+  std::map<std::vector<ReportTypeTag>, Constant *> TagArrays;
+  DenseMap<Type *, std::string> TyStrs;
+  // ReportTypeLayouts of struct types, see GetTypeLayout
+  DenseMap<StructType *, Constant *> Layouts;
+  std::map<std::vector<Constant *>, Constant *> LayoutArrays;
+  // report entry points by name, declared when first called
+  StringMap<FunctionCallee> ReportHooks;
+  // added to llvm.compiler.used at once after instrumenting the module
+  std::vector<GlobalValue *> Descs;
+};
+
+/**
+ * @brief Rule of a -report-filter file
+ */
+struct FilterRule {
+  enum { FullName, FuncName, SourceFile } Kind;
+  bool Deny;
+  GlobPattern Pattern;
+};
+
+/**
+ * @brief Functions selected by -report-filter and -report-profile
+ * @details loaded once per instrumented module
+ */
+struct FuncSelection {
+  std::vector<FilterRule> Rules;
+  bool HasAllowRules = false;
+  // entry counts of an instrumentation profile by PGO function name
+  StringMap<uint64_t> EntryCounts;
+  std::unique_ptr<sampleprof::SampleProfileReader> Samples;
+};
+
+/**
+ * @brief Report pass for the new pass manager
+ * @details runs on the whole module, `-fpass-plugin` schedules it after the
+ * optimization pipeline so the code that is shipped is instrumented
+ */
+struct ReportPass : public PassInfoMixin<ReportPass> {
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+/**
+ * @brief Report pass for the legacy pass manager, `opt -report`
+ */
+struct LegacyReportPass : public ModulePass {
   static char ID;
-  ReportPass() : FunctionPass(ID) {}
+  LegacyReportPass() : ModulePass(ID) {}
 
-  virtual bool runOnFunction(Function &F);
+  virtual bool runOnModule(Module &M);
 };
 } // namespace
 
-Constant *MakeGlobalString(Module *M, std::string str) {
-  // https://lists.llvm.org/pipermail/llvm-dev/2010-June/032075.html
-  // https://stackoverflow.com/questions/51809274/llvm-defining-strings-and-arrays-via-c-api
-
-  LLVMContext &Ctx = M->getContext();
-  std::vector<llvm::Constant *> chars(str.size());
-  for (unsigned int i = 0; i < str.size(); i++) {
-    chars[i] = ConstantInt::get(Type::getInt8Ty(Ctx), str[i]);
+/**
+ * @brief Get a pointer to a null-terminated constant string
+ * @details identical strings of a module share one private global
+ */
+Constant *MakeGlobalString(Module &M, ModuleCache &Cache, StringRef Str) {
+  Constant *&Ptr = Cache.Strings[Str];
+  if (Ptr) {
+    return Ptr;
   }
-  // add a zero terminator
-  chars.push_back(llvm::ConstantInt::get(Type::getInt8Ty(Ctx), 0));
 
-  auto init = ConstantArray::get(
-      ArrayType::get(Type::getInt8Ty(Ctx), chars.size()), chars);
-  GlobalVariable *v = new GlobalVariable(
-      *M, init->getType(), true, GlobalVariable::ExternalLinkage, init, str);
-  return ConstantExpr::getBitCast(v, Type::getInt8Ty(Ctx)->getPointerTo());
+  LLVMContext &Ctx = M.getContext();
+  Constant *Init = ConstantDataArray::getString(Ctx, Str);
+  GlobalVariable *V =
+      new GlobalVariable(M, Init->getType(), true, GlobalValue::PrivateLinkage,
+                         Init, "report_str");
+  V->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  V->setAlignment(Align(1));
+  Ptr = ConstantExpr::getBitCast(V, Type::getInt8PtrTy(Ctx));
+  return Ptr;
 }
 
 bool isStructPtrTy(Type *T) {
@@ -83,17 +199,13 @@ std::vector<Value *> ExpandStruct(Value *v, Function *F, Instruction *I,
     return Expanded;
   }
 
-  auto &entry = F->getEntryBlock();
   int len = StructTy->getStructNumElements();
   for (int i = 0; i < len; i++) {
-    // recursively expanding, so the first index is always 0
-    Value *indices[] = {ConstantInt::get(Type::getInt32Ty(Ctx), 0),
-                        ConstantInt::get(Type::getInt32Ty(Ctx), i)};
-    GetElementPtrInst *gep =
-        GetElementPtrInst::CreateInBounds(StructTy, v, indices, "", I);
-
-    Type *BaseTy = gep->getType()->getPointerElementType();
-    if (BaseTy->isPointerTy()) {
+    Type *BaseTy = StructTy->getElementType(i);
+    // the runtime follows pointers to structs by their layout,
+    // so the address of the field is reported
+    bool Follow = isStructPtrTy(BaseTy);
+    if (BaseTy->isPointerTy() && !Follow) {
       /**
        * https://github.com/SecurityLab-UCD/ReportFunctionExecutedPass/pull/4#discussion_r1149958372
        * struct in a struct is **not** always a pointer
@@ -101,101 +213,430 @@ std::vector<Value *> ExpandStruct(Value *v, Function *F, Instruction *I,
        * if no, there might be a Exit Code 139 Segmentation fault for
        * referencing null pointer
        */
-      Value *po = gep->getPointerOperand();
-      Type *poTy = po->getType();
-      if (po && poTy->isPointerTy() && isStructPtrTy(poTy)) {
-        std::vector<Value *> elems = ExpandStruct(po, F, I, expend_level - 1);
+      Type *poTy = v->getType();
+      if (poTy->isPointerTy() && isStructPtrTy(poTy)) {
+        std::vector<Value *> elems = ExpandStruct(v, F, I, expend_level - 1);
         Expanded.insert(Expanded.end(), elems.begin(), elems.end());
       }
     } else {
-      Expanded.push_back(gep);
+      // recursively expanding, so the first index is always 0
+      Value *indices[] = {ConstantInt::get(Type::getInt32Ty(Ctx), 0),
+                          ConstantInt::get(Type::getInt32Ty(Ctx), i)};
+      Expanded.push_back(
+          GetElementPtrInst::CreateInBounds(StructTy, v, indices, "", I));
     }
   }
 
   return Expanded;
 }
 
-std::string GetTyStr(std::vector<Value *> &elems, std::string delimiter) {
+/**
+ * @brief Get the printed name of a type
+ * @details printing a type walks all of its contained types, the names are
+ * cached as the same few types occur in most functions of a module
+ */
+const std::string &GetTyName(ModuleCache &Cache, Type *T) {
+  auto It = Cache.TyStrs.find(T);
+  if (It == Cache.TyStrs.end()) {
+    std::string Name;
+    llvm::raw_string_ostream rso(Name);
+    T->print(rso);
+    It = Cache.TyStrs.try_emplace(T, std::move(rso.str())).first;
+  }
+  return It->second;
+}
+
+std::string GetTyStr(ModuleCache &Cache, std::vector<Value *> &elems,
+                     const std::string &delimiter) {
   std::string TyStr;
-  llvm::raw_string_ostream rso(TyStr);
   for (Value *elem : elems) {
-    elem->getType()->print(rso);
-    rso << delimiter;
+    TyStr += GetTyName(Cache, elem->getType());
+    TyStr += delimiter;
   }
   return TyStr;
 }
 
+/**
+ * @brief Encode the type of a reported value for the runtime
+ * @param T: type of the reported value
+ * @return tag with the kind and bit width of the (pointer base) type
+ */
+ReportTypeTag GetTyTag(Type *T) {
+  unsigned PtrLevel = 0;
+  while (T->isPointerTy()) {
+    T = T->getPointerElementType();
+    PtrLevel++;
+  }
+
+  unsigned Kind = RTK_Unknown;
+  switch (T->getTypeID()) {
+  case Type::IntegerTyID:
+    Kind = RTK_Int;
+    break;
+  case Type::HalfTyID:
+  case Type::BFloatTyID:
+  case Type::FloatTyID:
+    Kind = RTK_Float;
+    break;
+  case Type::DoubleTyID:
+    Kind = RTK_Double;
+    break;
+  case Type::FP128TyID:
+    Kind = RTK_FP128;
+    break;
+  case Type::X86_FP80TyID:
+  case Type::PPC_FP128TyID:
+    Kind = RTK_LongDouble;
+    break;
+  case Type::VoidTyID:
+    Kind = RTK_Void;
+    break;
+  case Type::FunctionTyID:
+    Kind = RTK_Func;
+    break;
+  case Type::StructTyID:
+    Kind = RTK_Struct;
+    break;
+  default:
+    break;
+  }
+  return report_make_tag(Kind, PtrLevel, T->getScalarSizeInBits());
+}
+
+/**
+ * @brief Layout of ReportFieldDesc in ReportDesc.h
+ * @details layouts are referred to as i8* so the types are not recursive
+ */
+StructType *GetFieldDescTy(LLVMContext &Ctx) {
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  return StructType::get(Ctx, {I32Ty, I32Ty, Type::getInt8PtrTy(Ctx)});
+}
+
+/**
+ * @brief Layout of ReportTypeLayout in ReportDesc.h
+ */
+StructType *GetTypeLayoutTy(LLVMContext &Ctx) {
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  return StructType::get(Ctx, {Type::getInt8PtrTy(Ctx), I32Ty, I32Ty,
+                               GetFieldDescTy(Ctx)->getPointerTo()});
+}
+
+Constant *GetTypeLayout(Module &M, ModuleCache &Cache, StructType *STy);
+
+/**
+ * @brief Append the ReportFieldDescs of a struct's fields
+ * @details fields of nested structs are flattened, arrays and vectors are
+ * skipped
+ * @param Base: offset of the struct in the outermost struct
+ */
+void AppendFieldDescs(Module &M, ModuleCache &Cache, StructType *STy,
+                      uint64_t Base, std::vector<Constant *> &Fields) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  const StructLayout *SL = M.getDataLayout().getStructLayout(STy);
+  for (unsigned i = 0; i < STy->getNumElements(); i++) {
+    Type *ElemTy = STy->getElementType(i);
+    uint64_t Offset = Base + SL->getElementOffset(i);
+    if (StructType *Inner = dyn_cast<StructType>(ElemTy)) {
+      AppendFieldDescs(M, Cache, Inner, Offset, Fields);
+      continue;
+    }
+    if (ElemTy->isArrayTy() || ElemTy->isVectorTy()) {
+      continue;
+    }
+
+    Constant *Layout = ConstantPointerNull::get(Type::getInt8PtrTy(Ctx));
+    if (isStructPtrTy(ElemTy)) {
+      Layout = GetTypeLayout(
+          M, Cache, cast<StructType>(ElemTy->getPointerElementType()));
+    }
+    Fields.push_back(ConstantStruct::get(
+        GetFieldDescTy(Ctx), {ConstantInt::get(I32Ty, Offset),
+                              ConstantInt::get(I32Ty, GetTyTag(ElemTy)),
+                              Layout}));
+  }
+}
+
+/**
+ * @brief Get the ReportTypeLayout of a struct type, emitted once per module
+ * @return pointer to the layout as i8*, null for opaque structs
+ */
+Constant *GetTypeLayout(Module &M, ModuleCache &Cache, StructType *STy) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  auto It = Cache.Layouts.find(STy);
+  if (It != Cache.Layouts.end()) {
+    return It->second;
+  }
+  if (!STy->isSized()) {
+    Constant *Null = ConstantPointerNull::get(Type::getInt8PtrTy(Ctx));
+    Cache.Layouts[STy] = Null;
+    return Null;
+  }
+
+  StructType *LayoutTy = GetTypeLayoutTy(Ctx);
+  GlobalVariable *V = new GlobalVariable(
+      M, LayoutTy, true, GlobalValue::PrivateLinkage, nullptr, "report_layout");
+  Constant *Ptr = ConstantExpr::getBitCast(V, Type::getInt8PtrTy(Ctx));
+  // recursive types refer to their own layout
+  Cache.Layouts[STy] = Ptr;
+
+  std::vector<Constant *> Fields;
+  AppendFieldDescs(M, Cache, STy, 0, Fields);
+  PointerType *FieldPtrTy = GetFieldDescTy(Ctx)->getPointerTo();
+  Constant *FieldsPtr = ConstantPointerNull::get(FieldPtrTy);
+  if (!Fields.empty()) {
+    ArrayType *FieldsTy = ArrayType::get(GetFieldDescTy(Ctx), Fields.size());
+    GlobalVariable *FieldsVar = new GlobalVariable(
+        M, FieldsTy, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(FieldsTy, Fields), "report_fields");
+    FieldsPtr = ConstantExpr::getBitCast(FieldsVar, FieldPtrTy);
+  }
+
+  V->setInitializer(ConstantStruct::get(
+      LayoutTy,
+      {MakeGlobalString(M, Cache, GetTyName(Cache, STy)),
+       ConstantInt::get(I32Ty, M.getDataLayout().getTypeAllocSize(STy)),
+       ConstantInt::get(I32Ty, Fields.size()), FieldsPtr}));
+  return Ptr;
+}
+
+/**
+ * @brief Get the layout of the pointee of a reported value
+ * @return layout as i8*, null if the value is not a pointer to a struct
+ */
+Constant *GetValueLayout(Module &M, ModuleCache &Cache, Type *T) {
+  unsigned PtrLevel = 0;
+  while (T->isPointerTy()) {
+    T = T->getPointerElementType();
+    PtrLevel++;
+  }
+  if (PtrLevel > 0 && T->isStructTy()) {
+    return GetTypeLayout(M, Cache, cast<StructType>(T));
+  }
+  return ConstantPointerNull::get(Type::getInt8PtrTy(M.getContext()));
+}
+
+/**
+ * @brief Append the tags, type names and layouts of reported values to a
+ * descriptor
+ * @param Vals: values passed to report_param
+ * @param Tags: tags of the descriptor to append to
+ * @param TyStr: type names of the descriptor to append to
+ * @param Layouts: pointee layouts of the descriptor to append to
+ * @param delimiter: delimiter terminating each type name
+ */
+void DescribeValues(Module &M, ModuleCache &Cache, std::vector<Value *> &Vals,
+                    std::vector<ReportTypeTag> &Tags, std::string &TyStr,
+                    std::vector<Constant *> &Layouts,
+                    const std::string &delimiter) {
+  for (Value *V : Vals) {
+    Tags.push_back(GetTyTag(V->getType()));
+    Layouts.push_back(GetValueLayout(M, Cache, V->getType()));
+  }
+  TyStr += GetTyStr(Cache, Vals, delimiter);
+}
+
 bool is_in(std::string str, std::vector<std::string> &vec) {
   return std::find(vec.begin(), vec.end(), str) != vec.end();
 }
 
-std::vector<Value *> ReportInputs(Function &F, FunctionCallee &ReportParam,
-                                  raw_string_ostream &rso,
-                                  std::string delimiter) {
-  Instruction *EntryInst = &*F.getEntryBlock().begin();
-  LLVMContext &Ctx = F.getContext();
+/// constructor inserted by InsertDescRegistration, never instrumented
+static const char *RegisterDescsCtorName = "report.register_descs";
+
+/**
+ * @brief Layout of ReportFuncDesc in ReportDesc.h
+ */
+StructType *GetFuncDescTy(LLVMContext &Ctx) {
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  Type *I8PtrTy = Type::getInt8PtrTy(Ctx);
+  Type *TagPtrTy = I32Ty->getPointerTo();
+  Type *LayoutsTy = I8PtrTy->getPointerTo();
+  return StructType::get(Ctx, {I8PtrTy, TagPtrTy, TagPtrTy, I8PtrTy, I8PtrTy,
+                               I32Ty, I32Ty, I32Ty, I32Ty, LayoutsTy, LayoutsTy,
+                               I32Ty});
+}
+
+// fields of ReportFuncDesc the instrumentation reads at runtime
+enum FuncDescField { FuncDescId = 7, FuncDescFlags = 8 };
+
+Value *LoadDescField(IRBuilder<> &IRB, GlobalVariable *DescVar,
+                     FuncDescField Field, const Twine &Name) {
+  Value *Addr = IRB.CreateConstInBoundsGEP2_32(DescVar->getValueType(),
+                                               DescVar, 0, Field);
+  // the runtime updates the fields from other threads, a monotonic load is
+  // still a plain load on common targets
+  LoadInst *Load = IRB.CreateLoad(IRB.getInt32Ty(), Addr, Name);
+  Load->setAtomic(AtomicOrdering::Monotonic);
+  return Load;
+}
+
+/**
+ * @brief Convert a reported value to the type it is passed to the runtime as
+ * @details integers are zero-extended to i64 (the runtime sign-extends them
+ * by their type tag), pointers are converted to i64 and floating-point values
+ * to double, other values are only reported by their type
+ */
+Value *CastToReportTy(IRBuilder<> &IRB, Value *V) {
+  Type *T = V->getType();
+  if (T->isFloatingPointTy()) {
+    return IRB.CreateFPCast(V, IRB.getDoubleTy());
+  } else if (T->isIntegerTy()) {
+    return IRB.CreateZExtOrTrunc(V, IRB.getInt64Ty());
+  } else if (T->isPointerTy()) {
+    return IRB.CreatePtrToInt(V, IRB.getInt64Ty());
+  }
+  return IRB.getInt64(0);
+}
+
+/**
+ * @brief Insert a call to the report entry point matching the values
+ * @details one or two values are passed in registers to
+ * report_<i64|f64>[_<i64|f64>], any other number of values is spilled into
+ * a stack buffer of raw 64-bit slots passed to report_packed
+ * @param F: function being instrumented
+ * @param IsRnt: whether the values are outputs
+ * @param DescVar: descriptor of the function
+ * @param Vals: values to report
+ * @param InsertB4: instruction to insert the call before
+ */
+void InsertReportCall(ModuleCache &Cache, Function &F, bool IsRnt,
+                      GlobalVariable *DescVar, std::vector<Value *> &Vals,
+                      Instruction *InsertB4) {
   Module *M = F.getParent();
+  IRBuilder<> IRB(InsertB4);
+  // the dense ID of this function is assigned by the runtime when it
+  // registers the descriptor
+  Value *FuncId = LoadDescField(IRB, DescVar, FuncDescId, "report_id");
+
+  std::vector<Value *> Args;
+  for (Value *V : Vals) {
+    Args.push_back(CastToReportTy(IRB, V));
+  }
+
+  std::vector<Type *> ArgTys({IRB.getInt1Ty(), IRB.getInt32Ty()});
+  std::vector<Value *> CallArgs({IRB.getInt1(IsRnt), FuncId});
+  std::string Callee;
+  if (Args.size() == 1 || Args.size() == 2) {
+    Callee = "report";
+    for (Value *Arg : Args) {
+      Callee += Arg->getType()->isDoubleTy() ? "_f64" : "_i64";
+      ArgTys.push_back(Arg->getType());
+      CallArgs.push_back(Arg);
+    }
+  } else {
+    Callee = "report_packed";
+    Type *I64Ty = IRB.getInt64Ty();
+    Value *Slots = ConstantPointerNull::get(I64Ty->getPointerTo());
+    if (!Args.empty()) {
+      ArrayType *BufTy = ArrayType::get(I64Ty, Args.size());
+      AllocaInst *Buf = new AllocaInst(
+          BufTy, M->getDataLayout().getAllocaAddrSpace(), "report_slots",
+          &*F.getEntryBlock().getFirstInsertionPt());
+      for (unsigned i = 0; i < Args.size(); i++) {
+        Value *Slot = IRB.CreateBitCast(Args[i], I64Ty);
+        IRB.CreateStore(Slot, IRB.CreateConstInBoundsGEP2_32(BufTy, Buf, 0, i));
+      }
+      Slots = IRB.CreateConstInBoundsGEP2_32(BufTy, Buf, 0, 0);
+    }
+    ArgTys.push_back(I64Ty->getPointerTo());
+    ArgTys.push_back(IRB.getInt32Ty());
+    CallArgs.push_back(Slots);
+    CallArgs.push_back(IRB.getInt32(Args.size()));
+  }
 
+  FunctionCallee &Report = Cache.ReportHooks[Callee];
+  if (!Report) {
+    FunctionType *ReportFTy =
+        FunctionType::get(IRB.getInt32Ty(), ArgTys, false);
+    Report = M->getOrInsertFunction(Callee, ReportFTy);
+  }
+  IRB.CreateCall(Report, CallArgs, "report");
+}
+
+/**
+ * @brief Check whether the function still needs reporting
+ * @details the runtime sets the descriptor's flags once the function used up
+ * its report budget or while capture is disabled, the check is done once at
+ * entry so entry and exit
+ * reports of the same call stay paired
+ * @return i1 value that is true if the function's calls are reported
+ */
+Value *InsertReportCheck(GlobalVariable *DescVar, Instruction *InsertB4) {
+  IRBuilder<> IRB(InsertB4);
+  Value *Flags = LoadDescField(IRB, DescVar, FuncDescFlags, "report_flags");
+  return IRB.CreateICmpEQ(Flags, IRB.getInt32(0), "report_on");
+}
+
+/**
+ * @brief Split off a block that only runs if the function is reported
+ * @details the block is weighted as unlikely and moved to the end of the
+ * function, so a function that is not reported only pays for the check and
+ * a not taken branch
+ * @param ReportOn: value returned by InsertReportCheck
+ * @param SplitB4: instruction to split the block before
+ * @return terminator of the new block, to insert the reporting code before
+ */
+Instruction *InsertReportBlock(Value *ReportOn, Instruction *SplitB4) {
+  MDBuilder MDB(SplitB4->getContext());
+  Instruction *ReportB4 = SplitBlockAndInsertIfThen(
+      ReportOn, SplitB4, false, MDB.createBranchWeights(1, 1 << 20));
+  BasicBlock *ReportBB = ReportB4->getParent();
+  ReportBB->setName("report");
+  ReportBB->moveAfter(&ReportBB->getParent()->back());
+  return ReportB4;
+}
+
+/**
+ * @brief Collect the input values of a function
+ * @details struct pointer arguments are expanded into their fields by GEPs
+ * inserted before InsertB4
+ * @param PointerArgs: if not null, filled with the inputs that are pointers
+ * @return values to report as inputs
+ */
+std::vector<Value *> CollectInputs(Function &F, Instruction *InsertB4,
+                                   std::vector<Value *> *PointerArgs) {
   std::vector<Value *> InputArgs;
-  std::vector<Value *> PointerArgs;
   for (Value &Arg : F.args()) {
     if (isStructPtrTy(Arg.getType())) {
-      std::vector<Value *> elems = ExpandStruct(&Arg, &F, EntryInst);
+      std::vector<Value *> elems = ExpandStruct(&Arg, &F, InsertB4);
       InputArgs.insert(InputArgs.end(), elems.begin(), elems.end());
-      PointerArgs.insert(PointerArgs.end(), elems.begin(), elems.end());
-
-      // todo: get this type string from ExpandStruct
-      rso << GetTyStr(elems, delimiter);
+      if (PointerArgs) {
+        PointerArgs->insert(PointerArgs->end(), elems.begin(), elems.end());
+      }
     } else {
       InputArgs.push_back(&Arg);
-      Arg.getType()->print(rso);
 
-      if (Arg.getType()->isPointerTy()) {
-        PointerArgs.push_back(&Arg);
+      if (PointerArgs && Arg.getType()->isPointerTy()) {
+        PointerArgs->push_back(&Arg);
       }
     }
-    rso << delimiter;
   }
-
-  APInt InputArgsLen = APInt(32, InputArgs.size(), false);
-  InputArgs.insert(InputArgs.begin(), ConstantInt::get(Ctx, InputArgsLen));
-  InputArgs.insert(InputArgs.begin(), MakeGlobalString(M, rso.str()));
-  APInt IsRnt = APInt(1, false, false);
-  InputArgs.insert(InputArgs.begin(), ConstantInt::get(Ctx, IsRnt));
-  CallInst::Create(ReportParam, InputArgs, "report_param", EntryInst);
-  return PointerArgs;
+  return InputArgs;
 }
 
-void ReportOutputs(Function &F, FunctionCallee &ReportParam,
-                   std::vector<Value *> &PrevPointerInputs,
-                   raw_string_ostream &rso, std::string delimiter) {
-  std::vector<Value *> RetVals;
-  LLVMContext &Ctx = F.getContext();
-  Module *M = F.getParent();
+void ReportInputs(ModuleCache &Cache, Function &F, Instruction *EntryInst,
+                  GlobalVariable *DescVar, Value *ReportOn, FuncDescInfo &Desc,
+                  const std::string &delimiter) {
+  Instruction *ReportB4 = InsertReportBlock(ReportOn, EntryInst);
+  std::vector<Value *> InputArgs = CollectInputs(F, ReportB4, nullptr);
+  DescribeValues(*F.getParent(), Cache, InputArgs, Desc.InTags, Desc.InTypes,
+                 Desc.InLayouts, delimiter);
+  InsertReportCall(Cache, F, false, DescVar, InputArgs, ReportB4);
+}
 
-  // find rnt value and terminating instruction
-  Instruction *ReportInsertB4 = nullptr;
+void ReportOutputs(ModuleCache &Cache, Function &F, GlobalVariable *DescVar,
+                   Value *ReportOn, FuncDescInfo &Desc,
+                   const std::string &delimiter) {
+  // find terminating instructions
+  std::vector<ReturnInst *> Returns;
   for (BasicBlock &BB : F) {
     Instruction *Term = BB.getTerminator();
 
     // match on different type of terminator
     // empty else-if branches are reserved for later changes
     if (ReturnInst *RI = dyn_cast<ReturnInst>(Term)) {
-      ReportInsertB4 = RI;
-      if (RI->getNumOperands() == 1) {
-        Value *ReturnValue = RI->getOperand(0);
-        if (isStructPtrTy(ReturnValue->getType())) {
-          std::vector<Value *> elems = ExpandStruct(ReturnValue, &F, RI);
-          RetVals.insert(RetVals.end(), elems.begin(), elems.end());
-
-          // todo: get this type string from ExpandStruct
-          rso << GetTyStr(elems, delimiter);
-        } else {
-          RetVals.push_back(ReturnValue);
-          ReturnValue->getType()->print(rso);
-          rso << delimiter;
-        }
-      }
+      Returns.push_back(RI);
     } else if (SwitchInst *SI = dyn_cast<SwitchInst>(Term)) {
     } else if (BranchInst *BI = dyn_cast<BranchInst>(Term)) {
     } else if (IndirectBrInst *IBI = dyn_cast<IndirectBrInst>(Term)) {
@@ -219,51 +660,195 @@ void ReportOutputs(Function &F, FunctionCallee &ReportParam,
     }
   }
 
-  if (ReportInsertB4) {
-    // reinsert pointer inputs
-    for (Value *PointerInput : PrevPointerInputs) {
-      RetVals.push_back(PointerInput);
-      PointerInput->getType()->print(rso);
-      rso << delimiter;
+  for (ReturnInst *RI : Returns) {
+    // the values are only materialized if the call is reported
+    Instruction *ReportB4 = InsertReportBlock(ReportOn, RI);
+
+    // find rnt value
+    std::vector<Value *> RetVals;
+    if (RI->getNumOperands() == 1) {
+      Value *ReturnValue = RI->getOperand(0);
+      if (isStructPtrTy(ReturnValue->getType())) {
+        std::vector<Value *> elems = ExpandStruct(ReturnValue, &F, ReportB4);
+        RetVals.insert(RetVals.end(), elems.begin(), elems.end());
+      } else {
+        RetVals.push_back(ReturnValue);
+      }
+    }
+
+    // reinsert pointer inputs, unless the function cannot write to them
+    if (!F.onlyReadsMemory()) {
+      CollectInputs(F, ReportB4, &RetVals);
+    }
+    // all returns report values of the same types
+    if (RI == Returns.front()) {
+      DescribeValues(*F.getParent(), Cache, RetVals, Desc.OutTags,
+                     Desc.OutTypes, Desc.OutLayouts, delimiter);
     }
-    APInt RetValsLen = APInt(32, RetVals.size(), false);
-    RetVals.insert(RetVals.begin(), ConstantInt::get(Ctx, RetValsLen));
-    RetVals.insert(RetVals.begin(), MakeGlobalString(M, rso.str()));
-    APInt IsRnt = APInt(1, true, false);
-    RetVals.insert(RetVals.begin(), ConstantInt::get(Ctx, IsRnt));
-    CallInst::Create(ReportParam, RetVals, "report_param", ReportInsertB4);
+
+    InsertReportCall(Cache, F, true, DescVar, RetVals, ReportB4);
   }
 }
 
 /**
- * @brief Insert a signal handler before the given instruction
- * @param F Function to insert signal handler into
- * @param InsertBefore Instruction to insert signal handler before
- * @param SignalNum Signal number to register handler for
+ * @brief Dump the report when the program exits or is terminated
+ * @details inserts `atexit(dump_count)` and `signal(SIGTERM|SIGINT,
+ * signal_handler)` at the entry of the given function, the hooks are declared
+ * once per module
+ * @param F: main or LLVMFuzzerTestOneInput
  */
-void InsertSignalBefore(Function *F, Instruction *InsertBefore, int SignalNum) {
-  LLVMContext &Ctx = F->getContext();
-  Module *M = F->getParent();
+void InsertDumpAtExit(Function &F) {
+  Module &M = *F.getParent();
+  IRBuilder<> IRB(&*F.getEntryBlock().getFirstInsertionPt());
+  Type *VoidTy = IRB.getVoidTy();
+  Type *I32Ty = IRB.getInt32Ty();
 
-  // find function pointer to signal handler
-  std::vector<Type *> SignalHandlerArgsTys({Type::getInt32Ty(Ctx)});
-  FunctionType *SignalHandlerFTy =
-      FunctionType::get(Type::getVoidTy(Ctx), SignalHandlerArgsTys, false);
-  M->getOrInsertFunction("signal_handler", SignalHandlerFTy);
-  Function *SignalHandler = M->getFunction("signal_handler");
+  FunctionCallee Dump =
+      M.getOrInsertFunction("dump_count", FunctionType::get(VoidTy, false));
+  FunctionCallee SignalHandler = M.getOrInsertFunction(
+      "signal_handler", FunctionType::get(VoidTy, {I32Ty}, false));
+  FunctionCallee Signal = M.getOrInsertFunction(
+      "signal", FunctionType::get(VoidTy,
+                                  {I32Ty, SignalHandler.getCallee()->getType()},
+                                  false));
+  FunctionCallee Atexit = M.getOrInsertFunction(
+      "atexit",
+      FunctionType::get(I32Ty, {Dump.getCallee()->getType()}, false));
 
-  // find function pointer to signal
-  std::vector<Type *> SignalArgsTys(
-      {Type::getInt32Ty(Ctx), SignalHandler->getType()});
-  FunctionType *SignalFTy =
-      FunctionType::get(Type::getVoidTy(Ctx), SignalArgsTys, false);
-  FunctionCallee Signal = M->getOrInsertFunction("signal", SignalFTy);
-  Value *SIGTERM_Value = ConstantInt::get(Type::getInt32Ty(Ctx), SignalNum);
-  std::vector<Value *> SignalArgs({SIGTERM_Value, SignalHandler});
+  for (int SignalNum : {SIGTERM, SIGINT}) {
+    IRB.CreateCall(Signal,
+                   {IRB.getInt32(SignalNum), SignalHandler.getCallee()});
+  }
+  IRB.CreateCall(Atexit, {Dump.getCallee()}, "atexit");
+}
 
-  // insert call to signal at entry of main
-  Instruction *SignalInst =
-      CallInst::Create(Signal, SignalArgs, "", InsertBefore);
+/**
+ * @brief Make a private constant array of type tags
+ * @details functions with the same signature share one array
+ * @return pointer to the first tag, or null if there are no tags
+ */
+Constant *MakeTagArray(Module &M, ModuleCache &Cache,
+                       std::vector<ReportTypeTag> &Tags) {
+  Type *I32Ty = Type::getInt32Ty(M.getContext());
+  if (Tags.empty()) {
+    return ConstantPointerNull::get(I32Ty->getPointerTo());
+  }
+  Constant *&Ptr = Cache.TagArrays[Tags];
+  if (Ptr) {
+    return Ptr;
+  }
+  Constant *Init = ConstantDataArray::get(M.getContext(), Tags);
+  GlobalVariable *V =
+      new GlobalVariable(M, Init->getType(), true,
+                         GlobalValue::PrivateLinkage, Init, "report_tags");
+  V->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  Constant *Zero = ConstantInt::get(I32Ty, 0);
+  Ptr = ConstantExpr::getInBoundsGetElementPtr(Init->getType(), V,
+                                               ArrayRef<Constant *>{Zero, Zero});
+  return Ptr;
+}
+
+/**
+ * @brief Make a private constant array of layouts
+ * @details functions with the same signature share one array
+ * @return pointer to the first layout, or null if no layout is set
+ */
+Constant *MakeLayoutArray(Module &M, ModuleCache &Cache,
+                          std::vector<Constant *> &Layouts) {
+  PointerType *I8PtrTy = Type::getInt8PtrTy(M.getContext());
+  if (std::all_of(Layouts.begin(), Layouts.end(),
+                  [](Constant *L) { return L->isNullValue(); })) {
+    return ConstantPointerNull::get(I8PtrTy->getPointerTo());
+  }
+  Constant *&Ptr = Cache.LayoutArrays[Layouts];
+  if (Ptr) {
+    return Ptr;
+  }
+  ArrayType *ArrTy = ArrayType::get(I8PtrTy, Layouts.size());
+  GlobalVariable *V = new GlobalVariable(
+      M, ArrTy, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(ArrTy, Layouts), "report_layouts");
+  V->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  Ptr = ConstantExpr::getBitCast(V, I8PtrTy->getPointerTo());
+  return Ptr;
+}
+
+/**
+ * @brief Emit the descriptor of an instrumented function
+ * @param M: module of the function
+ * @param DescVar: descriptor global created before instrumenting, so the
+ * instrumentation can load its ID
+ * @param Desc: names and types reported by the instrumentation
+ */
+void EmitFuncDesc(Module &M, ModuleCache &Cache, GlobalVariable *DescVar,
+                  FuncDescInfo &Desc) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  Constant *NullStr = ConstantPointerNull::get(Type::getInt8PtrTy(Ctx));
+
+  DescVar->setInitializer(ConstantStruct::get(
+      cast<StructType>(DescVar->getValueType()),
+      {MakeGlobalString(M, Cache, Desc.Name),
+       MakeTagArray(M, Cache, Desc.InTags), MakeTagArray(M, Cache, Desc.OutTags),
+       Desc.InTypes.empty() ? NullStr
+                            : MakeGlobalString(M, Cache, Desc.InTypes),
+       Desc.OutTypes.empty() ? NullStr
+                             : MakeGlobalString(M, Cache, Desc.OutTypes),
+       ConstantInt::get(I32Ty, Desc.InTags.size()),
+       ConstantInt::get(I32Ty, Desc.OutTags.size()),
+       ConstantInt::get(I32Ty, REPORT_ID_UNREGISTERED),
+       ConstantInt::get(I32Ty, 0), MakeLayoutArray(M, Cache, Desc.InLayouts),
+       MakeLayoutArray(M, Cache, Desc.OutLayouts),
+       ConstantInt::get(I32Ty, Desc.Props)}));
+}
+
+/**
+ * @brief Register the descriptor section with the runtime at startup
+ * @details The linker concatenates all descriptors of an executable or
+ * shared library into one section, every module calls
+ * `report_register_descs` with the same bounds and the runtime registers
+ * them once.
+ * @param M: module to insert the constructor into
+ */
+void InsertDescRegistration(Module &M) {
+  if (M.getFunction(RegisterDescsCtorName)) {
+    return;
+  }
+
+  LLVMContext &Ctx = M.getContext();
+  Type *I32Ty = Type::getInt32Ty(Ctx);
+  StructType *FuncDescTy = GetFuncDescTy(Ctx);
+
+  auto SectionBound = [&](std::string Name) {
+    GlobalVariable *Bound = new GlobalVariable(
+        M, FuncDescTy, false, GlobalValue::ExternalWeakLinkage, nullptr, Name);
+    Bound->setVisibility(GlobalValue::HiddenVisibility);
+    return Bound;
+  };
+  GlobalVariable *Start =
+      SectionBound(std::string("__start_") + REPORT_DESC_SECTION);
+  GlobalVariable *Stop =
+      SectionBound(std::string("__stop_") + REPORT_DESC_SECTION);
+
+  PointerType *FuncDescPtrTy = FuncDescTy->getPointerTo();
+  FunctionType *RegisterFTy =
+      FunctionType::get(Type::getVoidTy(Ctx),
+                        {I32Ty, FuncDescPtrTy, FuncDescPtrTy}, false);
+  FunctionCallee Register =
+      M.getOrInsertFunction("report_register_descs", RegisterFTy);
+
+  Function *Ctor =
+      Function::Create(FunctionType::get(Type::getVoidTy(Ctx), false),
+                       GlobalValue::InternalLinkage, RegisterDescsCtorName, M);
+  IRBuilder<> IRB(BasicBlock::Create(Ctx, "", Ctor));
+  IRB.CreateCall(Register,
+                 {ConstantInt::get(I32Ty, REPORT_DESC_VERSION), Start, Stop});
+  IRB.CreateRetVoid();
+
+  // register before the constructors of the program call into instrumented
+  // code, priorities up to 100 are reserved for the implementation. Calls
+  // before registration are not reported, see report_packed.
+  appendToGlobalCtors(M, Ctor, 101);
 }
 
 /**
@@ -277,7 +862,234 @@ bool skip(std::string fname) {
          fname.find("cxx") != std::string::npos;
 }
 
-bool ReportPass::runOnFunction(Function &F) {
+/**
+ * @brief Read the rules of a -report-filter file
+ * @details one glob pattern per line, `fun:<glob>` matches the function
+ * name, `src:<glob>` the source file and any other pattern the whole
+ * `file?func` name. A leading `!` denies instead of allows, `#` starts a
+ * comment.
+ */
+void LoadFilter(FuncSelection &Sel, Module &M, StringRef Path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(Path);
+  if (!Buf) {
+    M.getContext().emitError("report-filter: cannot read " + Path + ": " +
+                             Buf.getError().message());
+    return;
+  }
+  SmallVector<StringRef, 32> Lines;
+  (*Buf)->getBuffer().split(Lines, '\n');
+  for (StringRef Line : Lines) {
+    Line = Line.split('#').first.trim();
+    if (Line.empty()) {
+      continue;
+    }
+    bool Deny = Line.consume_front("!");
+    auto Kind = FilterRule::FullName;
+    if (Line.consume_front("fun:")) {
+      Kind = FilterRule::FuncName;
+    } else if (Line.consume_front("src:")) {
+      Kind = FilterRule::SourceFile;
+    }
+    Expected<GlobPattern> Pattern = GlobPattern::create(Line.trim());
+    if (!Pattern) {
+      M.getContext().emitError("report-filter: bad pattern " + Line + ": " +
+                               toString(Pattern.takeError()));
+      return;
+    }
+    Sel.Rules.push_back(FilterRule{Kind, Deny, std::move(*Pattern)});
+    Sel.HasAllowRules |= !Deny;
+  }
+}
+
+/**
+ * @brief Read the function entry counts of a -report-profile file
+ * @details instrumentation profiles are read whole, sample profiles are
+ * looked up per function. IR-level profiles without an entry block counter
+ * count a function by its hottest block. Any text file passes as a text
+ * instrumentation profile, so a file failing to read as one is tried as a
+ * sample profile.
+ */
+void LoadProfile(FuncSelection &Sel, Module &M, StringRef Path) {
+  Expected<std::unique_ptr<InstrProfReader>> Reader =
+      InstrProfReader::create(Path);
+  if (!Reader) {
+    consumeError(Reader.takeError());
+    auto Indexed = IndexedInstrProfReader::create(Path);
+    if (Indexed) {
+      Reader = std::unique_ptr<InstrProfReader>(std::move(*Indexed));
+    } else {
+      Reader = Indexed.takeError();
+    }
+  }
+  if (Reader) {
+    InstrProfReader &R = **Reader;
+    bool EntryFirst = !R.isIRLevelProfile() || R.instrEntryBBEnabled();
+    for (const NamedInstrProfRecord &Rec : R) {
+      if (Rec.Counts.empty()) {
+        continue;
+      }
+      uint64_t Count =
+          EntryFirst ? Rec.Counts[0]
+                     : *std::max_element(Rec.Counts.begin(), Rec.Counts.end());
+      uint64_t &Entry = Sel.EntryCounts[Rec.Name];
+      Entry = std::max(Entry, Count);
+    }
+    Error E = R.getError();
+    if (!E) {
+      return;
+    }
+    consumeError(std::move(E));
+    Sel.EntryCounts.clear();
+  } else {
+    consumeError(Reader.takeError());
+  }
+
+  auto Samples =
+      sampleprof::SampleProfileReader::create(Path.str(), M.getContext());
+  if (!Samples || (*Samples)->read()) {
+    M.getContext().emitError("report-profile: cannot read " + Path +
+                             " as an instrumentation or sample profile");
+    return;
+  }
+  Sel.Samples = std::move(*Samples);
+}
+
+/**
+ * @brief Load the selection the pass options ask for
+ */
+void LoadSelection(FuncSelection &Sel, Module &M) {
+  if (!ReportFilter.empty()) {
+    LoadFilter(Sel, M, ReportFilter);
+  }
+  if (!ReportProfile.empty()) {
+    LoadProfile(Sel, M, ReportProfile);
+  }
+}
+
+/**
+ * @brief Check if the filter rules let a function be instrumented
+ * @details denied if it matches a deny rule, or if there are allow rules
+ * and it matches none of them
+ */
+bool IsAllowed(const FuncSelection &Sel, Function &F, StringRef Name) {
+  StringRef Source = F.getParent()->getSourceFileName();
+  bool Allowed = !Sel.HasAllowRules;
+  for (const FilterRule &Rule : Sel.Rules) {
+    StringRef Subject = Rule.Kind == FilterRule::FuncName     ? F.getName()
+                        : Rule.Kind == FilterRule::SourceFile ? Source
+                                                              : Name;
+    if (!Rule.Pattern.match(Subject)) {
+      continue;
+    }
+    if (Rule.Deny) {
+      return false;
+    }
+    Allowed = true;
+  }
+  return Allowed;
+}
+
+/**
+ * @brief Check if a function is entered more than -report-hot-count times
+ * @details by the -report-profile, or by the entry count a profile used to
+ * optimize the module attached to it
+ */
+bool IsHot(const FuncSelection &Sel, Function &F) {
+  uint64_t Count = 0;
+  if (Optional<Function::ProfileCount> EC = F.getEntryCount()) {
+    Count = EC->getCount();
+  }
+  if (!Sel.EntryCounts.empty()) {
+    auto It = Sel.EntryCounts.find(getPGOFuncName(F));
+    if (It != Sel.EntryCounts.end()) {
+      Count = std::max(Count, It->second);
+    }
+  }
+  if (Sel.Samples) {
+    if (sampleprof::FunctionSamples *FS = Sel.Samples->getSamplesFor(F)) {
+      Count = std::max(Count, FS->getEntrySamples());
+    }
+  }
+  return Count > ReportHotCount;
+}
+
+/**
+ * @brief Check if reporting a function would not tell anything new
+ * @details true for functions whose body is only a return of nothing, a
+ * constant or an argument, and for functions that do not access memory and
+ * either take no arguments (their output never changes) or return nothing
+ * (they have no output)
+ */
+bool HasTrivialIO(Function &F) {
+  if (F.doesNotAccessMemory() && !F.isVarArg() &&
+      (F.arg_empty() || F.getReturnType()->isVoidTy())) {
+    return true;
+  }
+  if (F.size() != 1) {
+    return false;
+  }
+  Instruction *Term = F.getEntryBlock().getFirstNonPHIOrDbg();
+  ReturnInst *RI = dyn_cast<ReturnInst>(Term);
+  if (!RI) {
+    return false;
+  }
+  Value *RV = RI->getReturnValue();
+  return !RV || isa<Constant>(RV) || isa<Argument>(RV);
+}
+
+/**
+ * @brief Check if a function's outputs only depend on its reported inputs
+ * @details the function does not access memory and takes no pointers, so
+ * the runtime only needs to capture its outputs for new inputs
+ */
+bool IsDeterministic(Function &F) {
+  if (!F.doesNotAccessMemory() || F.isVarArg()) {
+    return false;
+  }
+  return std::none_of(F.arg_begin(), F.arg_end(), [](Argument &Arg) {
+    return Arg.getType()->isPointerTy();
+  });
+}
+
+/**
+ * @brief Drop the memory effects inferred for a function before it was
+ * instrumented
+ * @details the pass runs after the optimizer inferred attributes such as
+ * readnone, which the calls into the runtime invalidate. The calls of the
+ * function in the module carry them as well, they would still let later
+ * passes merge or hoist the calls.
+ */
+void DropMemoryAttrs(Function &F) {
+  static const Attribute::AttrKind Kinds[] = {
+      Attribute::ReadNone,
+      Attribute::ReadOnly,
+      Attribute::WriteOnly,
+      Attribute::ArgMemOnly,
+      Attribute::InaccessibleMemOnly,
+      Attribute::InaccessibleMemOrArgMemOnly,
+      Attribute::NoSync,
+      Attribute::NoFree,
+      Attribute::Speculatable};
+  for (Attribute::AttrKind Kind : Kinds) {
+    F.removeFnAttr(Kind);
+  }
+  for (User *U : F.users()) {
+    CallBase *CB = dyn_cast<CallBase>(U);
+    if (!CB || CB->getCalledOperand() != &F) {
+      continue;
+    }
+    for (Attribute::AttrKind Kind : Kinds) {
+      CB->removeFnAttr(Kind);
+    }
+  }
+}
+
+/**
+ * @brief Instrument a function of the module
+ * @return true if the function was changed
+ */
+bool InstrumentFunction(ModuleCache &Cache, const FuncSelection &Sel,
+                        Function &F) {
   std::string fname = F.getName().str();
   Module *M = F.getParent();
   BasicBlock &entry = F.getEntryBlock();
@@ -301,7 +1113,7 @@ bool ReportPass::runOnFunction(Function &F) {
     }
   }
 
-  if (skip(fname)) {
+  if (skip(fname) || fname == RegisterDescsCtorName) {
     return false;
   }
 
@@ -309,72 +1121,140 @@ bool ReportPass::runOnFunction(Function &F) {
   // insert atexit() at LLVMFuzzerTestOneInput function so fuzzers can dump
   if (fname == "main" || fname == "LLVMFuzzerTestOneInput") {
     // dump report at main exit
-
-    // find function pointer to dump_count
-    std::vector<Type *> dump_ArgTys({});
-    FunctionType *DumpFTy =
-        FunctionType::get(Type::getVoidTy(Ctx), dump_ArgTys, false);
-    M->getOrInsertFunction("dump_count", DumpFTy);
-    Function *dump = M->getFunction("dump_count");
-
-    // insert call to atexit at entry of main
-    std::vector<Type *> AtexitArgsTys({dump->getType()});
-    FunctionType *AtexitFTy =
-        FunctionType::get(Type::getInt32Ty(Ctx), AtexitArgsTys, false);
-    std::vector<Value *> AtexitArgs({dump});
-    FunctionCallee DumpAtexit = M->getOrInsertFunction("atexit", AtexitFTy);
-    Instruction *AtexitInst =
-        CallInst::Create(DumpAtexit, AtexitArgs, "atexit", EntryInst);
-
-    InsertSignalBefore(&F, AtexitInst, SIGTERM);
-    InsertSignalBefore(&F, AtexitInst, SIGINT);
-
+    InsertDumpAtExit(F);
   } else {
-
-    // report param
-    std::vector<Type *> ParamArgTys(
-        {Type::getInt1Ty(Ctx), Type::getInt8PtrTy(Ctx), Type::getInt32Ty(Ctx)});
-    FunctionType *ParamFTy =
-        FunctionType::get(Type::getInt32Ty(Ctx), ParamArgTys, true);
-    FunctionCallee ReportParam =
-        M->getOrInsertFunction("report_param", ParamFTy);
-
     // use something that would never be a substring of function name or llvm
     // type as delimiter, for now use ">>="
     // "," will be in function type
     std::string delimiter = ">>=";
-    // NOTE type string
-    // the first token is function name
-    // the middle tokens are parameter types
-    // the last token is return type
-    // func_name>>=param1_type>>=...>>=rnt_type>>=
-
+    // NOTE descriptor
+    // name is file_name?func_name
+    // input and output types are encoded as tags for the runtime,
+    // and as type names param1_type>>=...>>= for error messages
     char file_func_separater = '?';
-    std::string TypeStrStarter =
-        file_name + file_func_separater + fname + delimiter;
+    FuncDescInfo Desc;
+    Desc.Name = file_name + file_func_separater + fname;
+
+    if (!IsAllowed(Sel, F, Desc.Name)) {
+      NumFiltered++;
+      return false;
+    }
+    if (HasTrivialIO(F)) {
+      NumTrivialIO++;
+      return false;
+    }
+    if (IsHot(Sel, F)) {
+      NumHot++;
+      if (ReportHot == HotSkip) {
+        return false;
+      }
+      Desc.Props |= REPORT_PROP_SAMPLED;
+    }
+    if (IsDeterministic(F)) {
+      Desc.Props |= REPORT_PROP_DETERMINISTIC;
+      NumDeterministic++;
+    }
+
+    GlobalVariable *DescVar =
+        new GlobalVariable(*M, GetFuncDescTy(Ctx), false,
+                           GlobalValue::PrivateLinkage, nullptr, "report_desc");
+    DescVar->setSection(REPORT_DESC_SECTION);
+    DescVar->setAlignment(Align(8));
+    Cache.Descs.push_back(DescVar);
+
+    // keep static allocas in the entry block when splitting it
+    Instruction *ReportB4 = EntryInst;
+    while (isa<AllocaInst>(ReportB4) || isa<DbgInfoIntrinsic>(ReportB4)) {
+      ReportB4 = ReportB4->getNextNode();
+    }
+    Value *ReportOn = InsertReportCheck(DescVar, ReportB4);
 
     // insert call to report at entry with input parameters
-    std::string InputsTyStr = TypeStrStarter;
-    raw_string_ostream irso(InputsTyStr);
-    std::vector<Value *> PrevPointerInputs =
-        ReportInputs(F, ReportParam, irso, delimiter);
+    ReportInputs(Cache, F, ReportB4, DescVar, ReportOn, Desc, delimiter);
 
-    // todo: insert call to report at exit with return values
+    // insert call to report at every exit with return values
     // and pointer inputs
-    std::string OutputsTyStr = TypeStrStarter;
-    raw_string_ostream orso(OutputsTyStr);
-    ReportOutputs(F, ReportParam, PrevPointerInputs, orso, delimiter);
+    ReportOutputs(Cache, F, DescVar, ReportOn, Desc, delimiter);
+
+    EmitFuncDesc(*M, Cache, DescVar, Desc);
   }
+  DropMemoryAttrs(F);
   return true;
 }
 
-char ReportPass::ID = 0;
-static RegisterPass<ReportPass> X("report", "Report Function Executed Pass",
-                                  true, true);
+/**
+ * @brief Instrument all functions defined in the module
+ * @return true if the module was changed
+ */
+bool InstrumentModule(Module &M) {
+  ModuleCache Cache;
+  FuncSelection Sel;
+  LoadSelection(Sel, M);
+  // functions created while instrumenting are not instrumented
+  std::vector<Function *> Funcs;
+  for (Function &F : M) {
+    if (!F.isDeclaration()) {
+      Funcs.push_back(&F);
+    }
+  }
+
+  bool Changed = false;
+  for (Function *F : Funcs) {
+    Changed |= InstrumentFunction(Cache, Sel, *F);
+  }
+
+  if (!Cache.Descs.empty()) {
+    // appending rebuilds llvm.compiler.used, so it is done once per module
+    appendToCompilerUsed(M, Cache.Descs);
+    InsertDescRegistration(M);
+  }
+  return Changed;
+}
+
+PreservedAnalyses ReportPass::run(Module &M, ModuleAnalysisManager &MAM) {
+  return InstrumentModule(M) ? PreservedAnalyses::none()
+                             : PreservedAnalyses::all();
+}
+
+bool LegacyReportPass::runOnModule(Module &M) { return InstrumentModule(M); }
+
+char LegacyReportPass::ID = 0;
+static RegisterPass<LegacyReportPass> X("report",
+                                        "Report Function Executed Pass", false,
+                                        false);
 
 static void registerMyPass(const PassManagerBuilder &,
                            legacy::PassManagerBase &PM) {
-  PM.add(new ReportPass());
+  PM.add(new LegacyReportPass());
 }
+// the legacy pipeline at -O0 only runs EP_EnabledOnOptLevel0
+static RegisterStandardPasses
+    RegisterMyPass(PassManagerBuilder::EP_OptimizerLast, registerMyPass);
 static RegisterStandardPasses
-    RegisterMyPass(PassManagerBuilder::EP_EarlyAsPossible, registerMyPass);
+    RegisterMyPassO0(PassManagerBuilder::EP_EnabledOnOptLevel0,
+                     registerMyPass);
+
+/**
+ * @brief Entry point of the new pass manager plugin
+ * @details `clang -fpass-plugin=libReportPass.so` runs the pass last in the
+ * optimization pipeline, after inlining, and `opt -load-pass-plugin
+ * libReportPass.so -passes=report` runs it on its own
+ */
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "ReportPass", "v0.1",
+          [](PassBuilder &PB) {
+            PB.registerOptimizerLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel Level) {
+                  MPM.addPass(ReportPass());
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "report") {
+                    MPM.addPass(ReportPass());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
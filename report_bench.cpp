@@ -0,0 +1,407 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ExecHashMap.hpp"
+#include "FastHash.hpp"
+#include "JsonWriter.hpp"
+#include "ReportDesc.h"
+#include "SlotFormat.hpp"
+
+// for convenience
+using namespace std;
+
+// entry points of the reporter the benchmark is linked with
+extern "C" void report_register_descs(uint32_t version, ReportFuncDesc *begin,
+                                      ReportFuncDesc *end);
+extern "C" int report_packed(bool is_rnt, uint32_t id, const uint64_t *slots,
+                             uint32_t len);
+extern "C" int report_i64(bool is_rnt, uint32_t id, uint64_t a);
+extern "C" int report_f64(bool is_rnt, uint32_t id, double a);
+
+/// @brief Keeps the compiler from dropping the work of a benchmark
+static volatile size_t sink;
+
+/// @brief Calls per measurement and best of how many measurements
+static long num_calls = 50000;
+static int num_repeats = 3;
+
+/**
+ * @brief Time a benchmark
+ * @param body: runs the benchmarked operation n times, its first argument
+ * is the index of the first operation, which only grows across repeats
+ * @return nanoseconds per operation of the fastest repeat
+ */
+template <typename Body> static double measure(long n, Body body) {
+  static long next = 0;
+  double best = 0;
+  for (int r = 0; r < num_repeats; r++) {
+    auto start = std::chrono::steady_clock::now();
+    body(next, n);
+    auto end = std::chrono::steady_clock::now();
+    next += n;
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    if (r == 0 || ns < best) {
+      best = ns;
+    }
+  }
+  return best / n;
+}
+
+/// @brief Print the result of a benchmark as one JSON object per line
+static void print_result(const char *bench, const string &name,
+                         const char *regime, double ns_per_call) {
+  printf("{\"bench\":\"%s\",\"case\":\"%s\",\"regime\":\"%s\",\"calls\":%ld,"
+         "\"ns_per_call\":%.2f}\n",
+         bench, name.c_str(), regime, num_calls, ns_per_call);
+  fflush(stdout);
+}
+
+/**
+ * @brief Signature of a benchmarked function as the pass describes it
+ */
+struct Signature {
+  const char *name;
+  vector<ReportTypeTag> in_tags;
+  const char *in_types;
+  vector<ReportTypeTag> out_tags;
+  const char *out_types;
+};
+
+static ReportTypeTag tag(unsigned kind, unsigned ptr_level, unsigned bits) {
+  return report_make_tag(kind, ptr_level, bits);
+}
+
+/// @brief Signatures of typical instrumented functions, a struct argument
+/// is reported as its fields like the pass expands it
+static vector<Signature> signatures() {
+  return {
+      {"all_int",
+       {tag(RTK_Int, 0, 32), tag(RTK_Int, 0, 32), tag(RTK_Int, 0, 64),
+        tag(RTK_Int, 0, 32)},
+       "i32>>=i32>>=i64>>=i32>>=",
+       {tag(RTK_Int, 0, 32)},
+       "i32>>="},
+      {"float_heavy",
+       {tag(RTK_Double, 0, 64), tag(RTK_Float, 0, 32), tag(RTK_Double, 0, 64),
+        tag(RTK_Double, 0, 64)},
+       "double>>=float>>=double>>=double>>=",
+       {tag(RTK_Double, 0, 64)},
+       "double>>="},
+      {"multi_ptr",
+       {tag(RTK_Int, 2, 32), tag(RTK_Int, 1, 8), tag(RTK_Double, 1, 64)},
+       "i32**>>=i8*>>=double*>>=",
+       {tag(RTK_Int, 0, 32)},
+       "i32>>="},
+      {"struct_expanded",
+       {tag(RTK_Int, 0, 32), tag(RTK_Double, 0, 64), tag(RTK_Int, 0, 64),
+        tag(RTK_Int, 1, 32), tag(RTK_Int, 0, 32)},
+       "i32>>=double>>=i64>>=i32*>>=i32>>=",
+       {tag(RTK_Int, 0, 32)},
+       "i32>>="},
+  };
+}
+
+/**
+ * @brief Values passed for the inputs of a signature
+ * @details pointers point into the argument object itself, so fresh values
+ * change the referents and not only the addresses
+ */
+struct Arguments {
+  int32_t i32;
+  int8_t i8;
+  double f64;
+  int32_t *i32_ptr;
+  uint64_t slots[8];
+
+  void fill(const vector<SlotInfo> &types, long v) {
+    i32 = (int32_t)v;
+    i8 = (int8_t)v;
+    f64 = v * 0.5;
+    i32_ptr = &i32;
+    for (size_t i = 0; i < types.size(); i++) {
+      const SlotInfo &slot = types[i];
+      if (slot.ptr_level == 2) {
+        slots[i] = to_slot(&i32_ptr);
+      } else if (slot.ptr_level == 1) {
+        slots[i] = slot.kind == RTK_Double
+                       ? to_slot(&f64)
+                       : (slot.bits == 8 ? to_slot(&i8) : to_slot(&i32));
+      } else if (slot.kind == RTK_Int) {
+        slots[i] = to_slot((uint64_t)(v + i));
+      } else {
+        slots[i] = to_slot(v * 0.25 + i);
+      }
+    }
+  }
+};
+
+/**
+ * @brief Time report_packed with the inputs of every signature at function
+ * entry and a scalar output at function exit
+ * @details fresh inputs add a new observation, and format it, with every
+ * call, repeated inputs only capture and hash them. A call is its entry and
+ * its exit.
+ */
+static void bench_report() {
+  vector<Signature> sigs = signatures();
+  // one descriptor per signature and regime, so the regimes do not share
+  // observations
+  vector<ReportFuncDesc> descs;
+  for (const char *regime : {"fresh", "repeated"}) {
+    for (Signature &sig : sigs) {
+      ReportFuncDesc fd;
+      fd.name = strdup((string("report_bench?") + sig.name + "_" + regime)
+                           .c_str());
+      fd.in_tags = sig.in_tags.data();
+      fd.out_tags = sig.out_tags.data();
+      fd.in_types = sig.in_types;
+      fd.out_types = sig.out_types;
+      fd.num_in = sig.in_tags.size();
+      fd.num_out = sig.out_tags.size();
+      fd.id = REPORT_ID_UNREGISTERED;
+      fd.flags = 0;
+      fd.in_layouts = nullptr;
+      fd.out_layouts = nullptr;
+      fd.props = 0;
+      descs.push_back(fd);
+    }
+  }
+  report_register_descs(REPORT_DESC_VERSION, descs.data(),
+                        descs.data() + descs.size());
+
+  for (size_t s = 0; s < sigs.size(); s++) {
+    const Signature &sig = sigs[s];
+    vector<SlotInfo> types =
+        decode_slots(sig.in_tags.data(), sig.in_tags.size(), sig.in_types);
+    bool float_out = sig.out_tags[0] == tag(RTK_Double, 0, 64);
+    for (int fresh = 1; fresh >= 0; fresh--) {
+      uint32_t id = descs[(fresh ? 0 : sigs.size()) + s].id;
+      Arguments args;
+      args.fill(types, 0);
+      double ns = measure(num_calls, [&](long first, long n) {
+        for (long v = first; v < first + n; v++) {
+          if (fresh) {
+            args.fill(types, v);
+          }
+          report_packed(false, id, args.slots, types.size());
+          if (float_out) {
+            report_f64(true, id, args.f64);
+          } else {
+            report_i64(true, id, args.i32);
+          }
+        }
+      });
+      print_result("report", sig.name, fresh ? "fresh" : "repeated", ns);
+    }
+  }
+}
+
+/**
+ * @brief Time decoding the type names of a descriptor and formatting the
+ * captured values of every signature
+ */
+static void bench_format() {
+  for (const Signature &sig : signatures()) {
+    double ns = measure(num_calls, [&](long, long n) {
+      for (long i = 0; i < n; i++) {
+        sink += parse_meta(sig.in_types).size();
+      }
+    });
+    print_result("parse_meta", sig.name, "repeated", ns);
+
+    vector<SlotInfo> types =
+        decode_slots(sig.in_tags.data(), sig.in_tags.size(), sig.in_types);
+    Arguments args;
+    vector<SlotCapture> captures(types.size());
+    ns = measure(num_calls, [&](long first, long n) {
+      for (long v = first; v < first + n; v++) {
+        args.fill(types, v);
+        for (size_t i = 0; i < types.size(); i++) {
+          SlotCapture &c = captures[i];
+          c.raw = args.slots[i];
+          c.state = CAPTURE_VALUE;
+          if (types[i].ptr_level > 0) {
+            memcpy(c.referent, &args.i32, sizeof(args.i32));
+          }
+        }
+        sink += format_captures(captures.data(), types).size();
+      }
+    });
+    print_result("format_captures", sig.name, "fresh", ns);
+  }
+}
+
+/// @brief Write values interned as IOSpans, see ValuePool::intern
+static void write_interned(JsonWriter &w, const ValuePool &pool, uint32_t,
+                           bool, StoredValues values) {
+  IOSpan span = (IOSpan)values;
+  w.put('[');
+  for (uint32_t i = 1; i <= span[0]; i++) {
+    if (i > 1) {
+      w.put(',');
+    }
+    w.string(pool.value(span[i]), pool.value_len(span[i]));
+  }
+  w.put(']');
+}
+
+/**
+ * @brief Report n observations of num_funcs functions to a table
+ * @details every input gets two outputs, values are interned like the
+ * reporter interns formatted values
+ */
+static void fill_table(ReportTable &table, long first, long n,
+                       uint32_t num_funcs, const vector<string> &names) {
+  for (long v = first; v < first + n; v++) {
+    uint32_t func_id = v % num_funcs;
+    long input = v / 2;
+    uint64_t in_hash = fast_hash_u64(func_id, input);
+    uint64_t out_hash = fast_hash_u64(in_hash, v & 1);
+    table.report(
+        func_id, names[func_id], in_hash, out_hash,
+        [&](ValuePool &pool) {
+          return (StoredValues)pool.intern(IOVector{
+              to_string(input), to_string(input * 0.5), "ptr[]"});
+        },
+        [&](ValuePool &pool, StoredValues) {
+          return (StoredValues)pool.intern(IOVector{to_string(v)});
+        });
+  }
+}
+
+/**
+ * @brief Time ReportTable::report, the hash map insert of the hot path,
+ * with fresh and with repeated observations
+ */
+static void bench_table() {
+  const uint32_t num_funcs = 256;
+  vector<string> names;
+  for (uint32_t f = 0; f < num_funcs; f++) {
+    names.push_back("report_bench?func_" + to_string(f));
+  }
+  ReportTable table(10);
+  double ns = measure(num_calls, [&](long first, long n) {
+    fill_table(table, first, n, num_funcs, names);
+  });
+  print_result("table_report", "interned", "fresh", ns);
+  ns = measure(num_calls, [&](long, long n) {
+    // already reported by the first fill
+    fill_table(table, 0, n, num_funcs, names);
+  });
+  print_result("table_report", "interned", "repeated", ns);
+}
+
+/**
+ * @brief Time writing the JSON report of tables of several sizes
+ * @param num_threads: threads formatting the report, see
+ * ReportTable::write_json
+ */
+static void bench_dump(unsigned num_threads) {
+  const uint32_t num_funcs = 256;
+  vector<string> names;
+  for (uint32_t f = 0; f < num_funcs; f++) {
+    names.push_back("report_bench?func_" + to_string(f));
+  }
+  char path[] = "/tmp/report_bench.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("report_bench");
+    return;
+  }
+  unlink(path);
+
+  for (long records : {1000L, 10000L, 100000L, 1000000L}) {
+    ReportTable table(10);
+    fill_table(table, 0, records, num_funcs, names);
+    for (unsigned threads : {1u, num_threads}) {
+      double best = 0;
+      off_t bytes = 0;
+      for (int r = 0; r < num_repeats; r++) {
+        if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+          perror("report_bench");
+          close(fd);
+          return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        table.write_json(fd, false, threads, write_interned);
+        auto end = std::chrono::steady_clock::now();
+        double s = std::chrono::duration<double>(end - start).count();
+        if (r == 0 || s < best) {
+          best = s;
+        }
+        bytes = lseek(fd, 0, SEEK_CUR);
+      }
+      printf("{\"bench\":\"dump\",\"records\":%ld,\"threads\":%u,"
+             "\"bytes\":%lld,\"mb_per_s\":%.2f}\n",
+             records, threads, (long long)bytes, bytes / best / 1e6);
+      fflush(stdout);
+      if (threads == num_threads) {
+        break;
+      }
+    }
+  }
+  close(fd);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-n calls] [-r repeats] [-j dump_threads] [bench...]\n"
+          "benchmarks: report format table dump, all by default\n",
+          argv0);
+}
+
+/**
+ * @brief Micro-benchmarks of the reporter's hot paths and of the dump
+ * @details results are printed as one JSON object per line, calls are timed
+ * in ns/call and dumps in MB/s, the best of -r repeats is reported
+ */
+int main(int argc, char **argv) {
+  unsigned num_threads =
+      std::min(std::max(std::thread::hardware_concurrency(), 1u), 8u);
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:j:")) != -1) {
+    switch (opt) {
+    case 'n':
+      num_calls = std::max(atol(optarg), 1L);
+      break;
+    case 'r':
+      num_repeats = std::max(atoi(optarg), 1);
+      break;
+    case 'j':
+      num_threads = std::max(atoi(optarg), 1);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  vector<string> benches(argv + optind, argv + argc);
+  if (benches.empty()) {
+    benches = {"report", "format", "table", "dump"};
+  }
+  for (const string &bench : benches) {
+    if (bench == "report") {
+      bench_report();
+    } else if (bench == "format") {
+      bench_format();
+    } else if (bench == "table") {
+      bench_table();
+    } else if (bench == "dump") {
+      bench_dump(num_threads);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  return 0;
+}
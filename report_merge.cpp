@@ -0,0 +1,559 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ExecHashMap.hpp"
+#include "FastHash.hpp"
+#include "JsonWriter.hpp"
+#include "TraceFile.hpp"
+
+// for convenience
+using json = nlohmann::json;
+using namespace std;
+
+static uint64_t hash_values(const IOVector &values) {
+  uint64_t h = fast_hash_u64(0, values.size());
+  for (const string &v : values) {
+    h = fast_hash_bytes(h, v.data(), v.size());
+  }
+  return h;
+}
+
+/**
+ * @brief Observations of one file, in the order they are in the file
+ */
+struct ParsedFile {
+  struct Observation {
+    uint32_t name; // index into names
+    IOVector inputs;
+    IOVector outputs;
+  };
+  vector<string> names;
+  vector<Observation> observations;
+
+  void add(const string &name, IOVector inputs, IOVector outputs) {
+    // the observations of a function are mostly next to each other
+    if (names.empty() || names.back() != name) {
+      names.push_back(name);
+    }
+    observations.push_back(Observation{(uint32_t)names.size() - 1,
+                                       std::move(inputs), std::move(outputs)});
+  }
+};
+
+/**
+ * @brief Merges the observations of many reports into a ReportTable
+ * @details files are parsed in parallel but merged one after the other in
+ * the order they are given, so the functions are numbered and the first
+ * MAX_REPORT_SIZE outputs of the same inputs are kept as with one thread.
+ * Only the functions of one partition are merged at a time, see selected().
+ */
+class Merger {
+private:
+  ReportTable &table;
+  unordered_map<string, uint32_t> ids;
+  uint32_t partition;
+  uint32_t num_partitions;
+
+  std::mutex lock;
+  std::condition_variable merged_cv;
+  // index of the next file to merge, files parsed before their turn wait in
+  // parsed
+  size_t next_file;
+  map<size_t, ParsedFile> parsed;
+  // files that may be parsed ahead of next_file, bounds the memory
+  size_t window;
+
+  uint32_t id_of(const string &name) {
+    return ids.emplace(name, ids.size()).first->second;
+  }
+
+  /**
+   * @brief Add an observation unless it was merged before
+   * @details like the reporter, only the first MAX_REPORT_SIZE distinct
+   * outputs of the same inputs are kept
+   */
+  void add(uint32_t func_id, const string &name, const IOVector &inputs,
+           const IOVector &outputs) {
+    table.report(
+        func_id, name, hash_values(inputs), hash_values(outputs),
+        [&](ValuePool &pool) { return (StoredValues)pool.intern(inputs); },
+        [&](ValuePool &pool, StoredValues) {
+          return (StoredValues)pool.intern(outputs);
+        });
+  }
+
+  void merge(const ParsedFile &file) {
+    vector<uint32_t> func_ids;
+    for (const string &name : file.names) {
+      func_ids.push_back(id_of(name));
+    }
+    for (const ParsedFile::Observation &o : file.observations) {
+      add(func_ids[o.name], file.names[o.name], o.inputs, o.outputs);
+    }
+  }
+
+public:
+  Merger(ReportTable &table, uint32_t num_partitions, unsigned num_threads)
+      : table(table), partition(0), num_partitions(num_partitions),
+        next_file(0), window(2 * (size_t)num_threads) {}
+
+  /// @brief Start merging the next partition into the cleared table
+  void next_partition() {
+    table.clear();
+    ids.clear();
+    next_file = 0;
+    partition++;
+  }
+
+  /// @brief Whether a function belongs to the partition being merged
+  bool selected(const string &name) const {
+    return num_partitions <= 1 ||
+           fast_hash_bytes(0, name.data(), name.size()) % num_partitions ==
+               partition;
+  }
+
+  /// @brief Wait until the i-th file may be parsed
+  void wait_turn(size_t i) {
+    std::unique_lock<std::mutex> guard(lock);
+    merged_cv.wait(guard, [&] { return i < next_file + window; });
+  }
+
+  /**
+   * @brief Merge the observations of the i-th file once the files before
+   * it are merged
+   * @details the thread of the file whose turn it is merges the files
+   * waiting for it as well
+   */
+  void commit(size_t i, ParsedFile file) {
+    std::unique_lock<std::mutex> guard(lock);
+    parsed.emplace(i, std::move(file));
+    if (i != next_file) {
+      return;
+    }
+    for (auto it = parsed.begin(); it != parsed.end() && it->first == next_file;
+         it = parsed.erase(it)) {
+      merge(it->second);
+      next_file++;
+    }
+    merged_cv.notify_all();
+  }
+};
+
+/**
+ * @brief Collects the observations of the selected functions of a JSON report
+ * while it is parsed
+ * @details [{"<function>": [[inputs, [outputs, ...]], ...]}, ...] or one
+ * {"<function>": [...]} object per line. The JSON document is never built in
+ * memory.
+ */
+class ReportSax : public nlohmann::json_sax<json> {
+private:
+  const Merger &merger;
+  ParsedFile &file;
+  int depth;
+  // depth of the object of the current function, 0 outside of one
+  int func_depth;
+  std::string name;
+  bool selected;
+  // 0 while the inputs of an observation are parsed, 1 for its outputs
+  int child;
+  IOVector inputs, outputs;
+
+public:
+  std::string error;
+
+  ReportSax(const Merger &merger, ParsedFile &file)
+      : merger(merger), file(file), depth(0), func_depth(0), selected(false),
+        child(0) {}
+
+  bool null() override { return true; }
+  bool boolean(bool) override { return true; }
+  bool number_integer(number_integer_t) override { return true; }
+  bool number_unsigned(number_unsigned_t) override { return true; }
+  bool number_float(number_float_t, const string_t &) override { return true; }
+  bool binary(binary_t &) override { return true; }
+
+  bool string(string_t &s) override {
+    if (!func_depth || !selected) {
+      return true;
+    }
+    int level = depth - func_depth;
+    if (level == 3 && child == 0) {
+      inputs.push_back(s);
+    } else if (level == 4 && child == 1) {
+      outputs.push_back(s);
+    }
+    return true;
+  }
+
+  bool start_object(std::size_t) override {
+    depth++;
+    if (!func_depth) {
+      func_depth = depth;
+    }
+    return true;
+  }
+
+  bool key(string_t &k) override {
+    if (depth == func_depth) {
+      name = k;
+      selected = merger.selected(name);
+    }
+    return true;
+  }
+
+  bool end_object() override {
+    if (depth == func_depth) {
+      func_depth = 0;
+    }
+    depth--;
+    return true;
+  }
+
+  bool start_array(std::size_t) override {
+    depth++;
+    switch (func_depth ? depth - func_depth : 0) {
+    case 2: // [inputs, [outputs, ...]]
+      child = -1;
+      break;
+    case 3:
+      if (++child == 0) {
+        inputs.clear();
+      }
+      break;
+    case 4:
+      outputs.clear();
+      break;
+    }
+    return true;
+  }
+
+  bool end_array() override {
+    if (func_depth && selected && depth - func_depth == 4 && child == 1) {
+      file.add(name, inputs, outputs);
+    }
+    depth--;
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string &,
+                   const nlohmann::detail::exception &e) override {
+    error = e.what();
+    return false;
+  }
+};
+
+/**
+ * @brief Parse a JSON report, either format the reporter dumps
+ * @return an error message, or an empty string
+ */
+static string parse_json(const char *data, size_t size, const Merger &merger,
+                         ParsedFile &file) {
+  const char *end = data + size;
+  const char *p = data;
+  while (p < end && isspace((unsigned char)*p)) {
+    p++;
+  }
+  ReportSax sax(merger, file);
+  if (p < end && *p != '{') {
+    json::sax_parse(p, end, &sax);
+    return sax.error;
+  }
+  // one object per line
+  while (p < end) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    const char *line_end = eol ? eol : end;
+    if (line_end > p && !json::sax_parse(p, line_end, &sax)) {
+      return sax.error;
+    }
+    p = line_end + 1;
+  }
+  return "";
+}
+
+/**
+ * @brief Parse a binary trace written with REPORT_TRACE, see trace2json
+ * @return an error message, or an empty string
+ */
+static string parse_trace(const char *path, const Merger &merger,
+                          ParsedFile &file) {
+  TraceReader reader;
+  if (const char *err = reader.open(path)) {
+    return err;
+  }
+  unordered_map<uint32_t, TracedFunc> funcs;
+  TracedLayouts layouts;
+  size_t malformed = 0;
+  reader.for_each([&](TraceRecordType type, const char *p, size_t size) {
+    if (type == TRACE_LAYOUT && !layouts.decode(p, size)) {
+      malformed++;
+    } else if (type == TRACE_FUNC) {
+      TraceFunc tf;
+      TracedFunc func;
+      if (!decode_trace_func(p, size, tf, func, layouts)) {
+        malformed++;
+      } else if (merger.selected(func.name)) {
+        funcs[tf.func_id] = func;
+      }
+    }
+  });
+
+  // input_ref -> inputs
+  unordered_map<uint64_t, IOVector> inputs;
+  bool complete = reader.for_each([&](TraceRecordType type, const char *p,
+                                      size_t size) {
+    if (type != TRACE_INPUT && type != TRACE_OUTPUT) {
+      return;
+    }
+    if (size < sizeof(TraceValues)) {
+      malformed++;
+      return;
+    }
+    TraceValues tv;
+    memcpy(&tv, p, sizeof(tv));
+    auto found = funcs.find(tv.func_id);
+    if (found == funcs.end()) {
+      return;
+    }
+    const TracedFunc &f = found->second;
+    IOVector values;
+    if (!decode_trace_values(p, size,
+                             type == TRACE_INPUT ? f.inputs : f.outputs, tv,
+                             values)) {
+      malformed++;
+      return;
+    }
+    if (type == TRACE_INPUT) {
+      inputs[tv.input_ref] = std::move(values);
+      return;
+    }
+    auto in = inputs.find(tv.input_ref);
+    if (in != inputs.end()) {
+      file.add(f.name, in->second, std::move(values));
+    }
+  });
+  if (malformed > 0) {
+    fprintf(stderr, "%s: %zu malformed records skipped\n", path, malformed);
+  }
+  if (!complete) {
+    fprintf(stderr, "%s ends with a truncated record\n", path);
+  }
+  return "";
+}
+
+/**
+ * @brief Parse the observations of a report or trace file
+ * @return false if the file could not be read, the observations read until
+ * then are kept
+ */
+static bool parse_file(const char *path, const Merger &merger,
+                       ParsedFile &file) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "%s: cannot open\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  string error;
+  if (st.st_size > 0) {
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      error = "cannot map";
+    } else {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      const char *data = (const char *)p;
+      if ((size_t)st.st_size >= sizeof(TraceHeader) &&
+          memcmp(data, TRACE_MAGIC, 8) == 0) {
+        error = parse_trace(path, merger, file);
+      } else {
+        error = parse_json(data, st.st_size, merger, file);
+      }
+      munmap(p, st.st_size);
+    }
+  }
+  close(fd);
+  if (!error.empty()) {
+    fprintf(stderr, "%s: %s\n", path, error.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Write interned values, see ValuePool::intern
+ */
+static void write_interned(JsonWriter &w, const ValuePool &pool, uint32_t,
+                           bool, StoredValues values) {
+  IOSpan span = (IOSpan)values;
+  w.put('[');
+  for (uint32_t i = 1; i <= span[0]; i++) {
+    if (i > 1) {
+      w.put(',');
+    }
+    w.string(pool.value(span[i]), pool.value_len(span[i]));
+  }
+  w.put(']');
+}
+
+/**
+ * @brief Append the merged partition to the report
+ * @details the JSON arrays of the partitions are joined into one
+ * @param any: whether a previous partition wrote a function
+ */
+static bool write_partition(int fd, ReportTable &table, bool ndjson,
+                            unsigned num_threads, bool &any) {
+  off_t start = lseek(fd, 0, SEEK_END);
+  if (!ndjson && any) {
+    // continue the array of the previous partitions
+    start = lseek(fd, start - 1, SEEK_SET);
+  }
+  if (!table.write_json(fd, ndjson, num_threads, write_interned)) {
+    return false;
+  }
+  char first = 0;
+  if (ndjson || pread(fd, &first, 1, start) != 1) {
+    return true;
+  }
+  if (first == 'n') {
+    // "null", nothing in this partition
+    if (ftruncate(fd, start) != 0 ||
+        (any && pwrite(fd, "]", 1, start) != 1)) {
+      return false;
+    }
+    return true;
+  }
+  if (any && pwrite(fd, ",", 1, start) != 1) {
+    return false;
+  }
+  any = true;
+  return true;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-j threads] [-n max_outputs] [-p partitions] [-l] "
+          "-o <report> <report or trace>...\n"
+          "  -j: number of threads, one per core by default\n"
+          "  -n: maximum number of outputs kept for the same inputs, "
+          "MAX_REPORT_SIZE or 10 by default\n"
+          "  -p: merge the functions in this many passes over the files, "
+          "each holding a part of the functions in memory\n"
+          "  -l: write one JSON object per function and line\n",
+          prog);
+}
+
+/**
+ * @brief Merge reports dumped by the reporter and traces written with
+ * REPORT_TRACE into one report
+ * @details the files are parsed in parallel and observations are kept with
+ * the same MAX_REPORT_SIZE cap as the reporter. The merged observations are
+ * held in memory, with -p the functions are split into partitions by the
+ * hash of their name and merged one partition at a time.
+ */
+int main(int argc, char **argv) {
+  unsigned num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+  int max_outputs = 10;
+  if (const char *env_p = getenv("MAX_REPORT_SIZE")) {
+    max_outputs = std::max(atoi(env_p), 1);
+  }
+  uint32_t num_partitions = 1;
+  bool ndjson = false;
+  const char *report_name = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:n:p:lo:")) != -1) {
+    switch (opt) {
+    case 'j':
+      num_threads = std::max(atoi(optarg), 1);
+      break;
+    case 'n':
+      max_outputs = std::max(atoi(optarg), 1);
+      break;
+    case 'p':
+      num_partitions = std::max(atoi(optarg), 1);
+      break;
+    case 'l':
+      ndjson = true;
+      break;
+    case 'o':
+      report_name = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!report_name || optind == argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  vector<const char *> files(argv + optind, argv + argc);
+
+  int fd = open(report_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "%s: cannot write %s\n", argv[0], report_name);
+    return 1;
+  }
+
+  ReportTable table(max_outputs);
+  Merger merger(table, num_partitions, num_threads);
+  // files that could not be read are skipped by later passes
+  vector<char> failed(files.size(), 0);
+  bool any = false;
+  for (uint32_t p = 0; p < num_partitions; p++) {
+    if (p > 0) {
+      merger.next_partition();
+    }
+    std::atomic<size_t> next(0);
+    auto worker = [&] {
+      for (size_t i; (i = next.fetch_add(1)) < files.size();) {
+        merger.wait_turn(i);
+        ParsedFile file;
+        if (!failed[i] && !parse_file(files[i], merger, file)) {
+          failed[i] = 1;
+        }
+        merger.commit(i, std::move(file));
+      }
+    };
+    vector<std::thread> workers;
+    for (unsigned t = 1; t < std::min<size_t>(num_threads, files.size());
+         t++) {
+      workers.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : workers) {
+      t.join();
+    }
+    if (!write_partition(fd, table, ndjson, num_threads, any)) {
+      fprintf(stderr, "%s: cannot write %s\n", argv[0], report_name);
+      close(fd);
+      return 1;
+    }
+  }
+  // nothing was merged, the file is empty
+  if (!ndjson && !any && pwrite(fd, "null", 4, 0) != 4) {
+    fprintf(stderr, "%s: cannot write %s\n", argv[0], report_name);
+  }
+  close(fd);
+  return std::count(failed.begin(), failed.end(), 1) > 0 ? 1 : 0;
+}
@@ -0,0 +1,556 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ReportDesc.h"
+#include "SlotFormat.hpp"
+
+// for convenience
+using namespace std;
+
+// entry points of the reporter the test is linked with
+extern "C" void report_register_descs(uint32_t version, ReportFuncDesc *begin,
+                                      ReportFuncDesc *end);
+extern "C" int report_packed(bool is_rnt, uint32_t id, const uint64_t *slots,
+                             uint32_t len);
+extern "C" void dump_count();
+
+static ReportTypeTag tag(unsigned kind, unsigned ptr_level, unsigned bits) {
+  return report_make_tag(kind, ptr_level, bits);
+}
+
+class Calls;
+
+/**
+ * @brief A function reported with the given calls and the report expected
+ * for it
+ */
+struct TestCase {
+  string name;
+  vector<ReportTypeTag> in_tags;
+  vector<ReportTypeTag> out_tags;
+  // pointee layouts of the inputs, empty if none is a struct
+  vector<const ReportTypeLayout *> in_layouts;
+  // reports the calls of the function, and of other functions by name
+  function<void(Calls &)> calls;
+  // records of the function in the dumped JSON, empty if it reports nothing
+  string expected;
+  // ReportFuncDesc::props
+  uint32_t props = 0;
+};
+
+/**
+ * @brief Reports calls the way instrumented code does
+ * @details a call is only reported if the function's flags are clear when
+ * it is entered, its return is reported if its entry was
+ */
+class Calls {
+private:
+  vector<ReportFuncDesc> &descs;
+  // function of the test case being run
+  ReportFuncDesc *current;
+  // whether the entries of the calls on the stack were reported
+  static thread_local vector<bool> reported;
+
+public:
+  Calls(vector<ReportFuncDesc> &descs, ReportFuncDesc *current)
+      : descs(descs), current(current) {}
+
+  ReportFuncDesc &desc(const string &name) {
+    for (ReportFuncDesc &fd : descs) {
+      if (name == fd.name) {
+        return fd;
+      }
+    }
+    fprintf(stderr, "no function %s\n", name.c_str());
+    exit(1);
+  }
+
+  void enter(ReportFuncDesc &fd, vector<uint64_t> inputs) {
+    bool report = __atomic_load_n(&fd.flags, __ATOMIC_RELAXED) == 0;
+    if (report) {
+      report_packed(false, fd.id, inputs.data(), inputs.size());
+    }
+    reported.push_back(report);
+  }
+
+  void ret(ReportFuncDesc &fd, vector<uint64_t> outputs) {
+    if (reported.back()) {
+      report_packed(true, fd.id, outputs.data(), outputs.size());
+    }
+    reported.pop_back();
+  }
+
+  void call(ReportFuncDesc &fd, vector<uint64_t> inputs,
+            vector<uint64_t> outputs) {
+    enter(fd, inputs);
+    ret(fd, outputs);
+  }
+
+  void call(vector<uint64_t> inputs, vector<uint64_t> outputs) {
+    call(*current, inputs, outputs);
+  }
+
+  /// @brief Enter a call that is left without a return, e.g. by longjmp
+  void enter_only(ReportFuncDesc &fd, vector<uint64_t> inputs) {
+    report_packed(false, fd.id, inputs.data(), inputs.size());
+  }
+
+  /// @brief Return from a call whose entry the reporter never saw
+  void ret_only(ReportFuncDesc &fd, vector<uint64_t> outputs) {
+    report_packed(true, fd.id, outputs.data(), outputs.size());
+  }
+};
+
+thread_local vector<bool> Calls::reported;
+
+/// @brief A list node with padding after its first field
+struct Node {
+  int8_t tag;
+  double val;
+  Node *next;
+};
+
+extern const ReportTypeLayout node_layout;
+static const ReportFieldDesc node_fields[] = {
+    {offsetof(Node, tag), report_make_tag(RTK_Int, 0, 8), nullptr},
+    {offsetof(Node, val), report_make_tag(RTK_Double, 0, 64), nullptr},
+    {offsetof(Node, next), report_make_tag(RTK_Struct, 1, 0), &node_layout},
+};
+const ReportTypeLayout node_layout = {"%struct.Node", sizeof(Node), 3,
+                                      node_fields};
+
+// functions reported from several threads, two per shard of the table,
+// with as many outputs for the same inputs as are kept by default
+static const int NUM_THREADED_FUNCS = 128;
+static const int NUM_THREADS = 8;
+static const int NUM_THREADED_OUTPUTS = 10;
+
+static string threaded_name(int k) {
+  return "report_test?threaded_" + to_string(k);
+}
+
+static uint64_t threaded_output(int k, int in, int out) {
+  return (k * 3 + in) * NUM_THREADED_OUTPUTS + out;
+}
+
+/**
+ * @brief Observations reported concurrently are neither lost nor duplicated
+ * @details all threads make the same calls in the same order, so the first
+ * report of every observation, and the order of the dumped records, does not
+ * depend on how the threads interleave
+ */
+static void add_threaded_cases(vector<TestCase> &cases) {
+  for (int k = 0; k < NUM_THREADED_FUNCS; k++) {
+    string expected = "[";
+    for (int in = 0; in < 3; in++) {
+      expected += string(in > 0 ? "," : "") + "[[\"" + to_string(in) + "\"],[";
+      for (int out = 0; out < NUM_THREADED_OUTPUTS; out++) {
+        expected += string(out > 0 ? "," : "") + "[\"" +
+                    to_string(threaded_output(k, in, out)) + "\"]";
+      }
+      expected += "]]";
+    }
+    cases.push_back({threaded_name(k),
+                     {tag(RTK_Int, 0, 32)},
+                     {tag(RTK_Int, 0, 32)},
+                     {},
+                     nullptr,
+                     expected + "]"});
+  }
+  cases.push_back(
+      {"report_test?threads", {}, {}, {}, [](Calls &c) {
+         vector<ReportFuncDesc *> funcs;
+         for (int k = 0; k < NUM_THREADED_FUNCS; k++) {
+           funcs.push_back(&c.desc(threaded_name(k)));
+         }
+         // start the threads at once so they insert the same observations
+         atomic<int> waiting(NUM_THREADS);
+         vector<thread> threads;
+         for (int t = 0; t < NUM_THREADS; t++) {
+           threads.emplace_back([&] {
+             waiting--;
+             while (waiting > 0) {
+               this_thread::yield();
+             }
+             for (int round = 0; round < 4; round++) {
+               for (int in = 0; in < 3; in++) {
+                 for (int out = 0; out < NUM_THREADED_OUTPUTS; out++) {
+                   for (int k = 0; k < NUM_THREADED_FUNCS; k++) {
+                     c.call(*funcs[k], {(uint64_t)in},
+                            {threaded_output(k, in, out)});
+                   }
+                 }
+               }
+             }
+           });
+         }
+         for (thread &t : threads) {
+           t.join();
+         }
+       }, ""});
+}
+
+// returns 100 more than the input, so a return paired with the inputs of
+// another call reports a wrong output
+static void nested(Calls &c, ReportFuncDesc &fd, uint64_t in,
+                   function<void()> inner) {
+  c.enter(fd, {in});
+  inner();
+  c.ret(fd, {in + 100});
+}
+
+static void even(Calls &c, uint64_t n);
+
+static void odd(Calls &c, uint64_t n) {
+  nested(c, c.desc("report_test?odd"), n, [&] { even(c, n - 1); });
+}
+
+static void even(Calls &c, uint64_t n) {
+  nested(c, c.desc("report_test?even"), n, [&] {
+    if (n > 0) {
+      odd(c, n - 1);
+    }
+  });
+}
+
+static void recurse(Calls &c, uint64_t n) {
+  nested(c, c.desc("report_test?recursion"), n, [&] {
+    if (n > 0) {
+      recurse(c, n - 1);
+    }
+  });
+}
+
+/**
+ * @brief Returns are paired with the inputs of their own call
+ * @details under direct and mutual recursion, across the frames of sampled
+ * calls that are not captured, and when an entry or a return is missing
+ */
+static void add_shadow_stack_cases(vector<TestCase> &cases) {
+  vector<ReportTypeTag> i32 = {tag(RTK_Int, 0, 32)};
+  cases.push_back({"report_test?recursion", i32, i32, {},
+                   [](Calls &c) { recurse(c, 2); },
+                   "[[[\"0\"],[[\"100\"]]],[[\"1\"],[[\"101\"]]],"
+                   "[[\"2\"],[[\"102\"]]]]"});
+  cases.push_back({"report_test?even", i32, i32, {},
+                   [](Calls &c) { even(c, 4); },
+                   "[[[\"0\"],[[\"100\"]]],[[\"2\"],[[\"102\"]]],"
+                   "[[\"4\"],[[\"104\"]]]]"});
+  cases.push_back({"report_test?odd", i32, i32, {}, nullptr,
+                   "[[[\"1\"],[[\"101\"]]],[[\"3\"],[[\"103\"]]]]"});
+  // only the first of REPORT_SAMPLE_PERIOD entries is captured, the entries
+  // nested in it push frames that are not
+  cases.push_back({"report_test?sampled", i32, i32, {},
+                   [](Calls &c) {
+                     ReportFuncDesc &sampled = c.desc("report_test?sampled");
+                     nested(c, sampled, 1, [&] {
+                       nested(c, sampled, 2, [&] {
+                         c.call(c.desc("report_test?in_sampled"), {3}, {103});
+                         nested(c, sampled, 4, [] {});
+                       });
+                     });
+                   },
+                   "[[[\"1\"],[[\"101\"]]]]", REPORT_PROP_SAMPLED});
+  cases.push_back({"report_test?in_sampled", i32, i32, {}, nullptr,
+                   "[[[\"3\"],[[\"103\"]]]]"});
+  cases.push_back({"report_test?unpaired", i32, i32, {},
+                   [](Calls &c) {
+                     ReportFuncDesc &unpaired = c.desc("report_test?unpaired");
+                     ReportFuncDesc &left = c.desc("report_test?left");
+                     ReportFuncDesc &unseen = c.desc("report_test?unseen");
+                     nested(c, unpaired, 1, [&] {
+                       // the frame of the call left without a return is
+                       // dropped by the return of its caller
+                       c.enter_only(left, {2});
+                       c.ret_only(unseen, {3});
+                     });
+                     c.ret_only(unpaired, {4});
+                     c.ret_only(left, {5});
+                   },
+                   "[[[\"1\"],[[\"101\"]]]]"});
+  cases.push_back({"report_test?left", i32, i32, {}, nullptr, ""});
+  cases.push_back({"report_test?unseen", i32, i32, {}, nullptr, ""});
+}
+
+/// @brief Fail the test unless the function used up its report budget
+static void check_saturated(ReportFuncDesc &fd) {
+  if (!(__atomic_load_n(&fd.flags, __ATOMIC_RELAXED) & REPORT_FLAG_SATURATED)) {
+    fprintf(stderr, "FAIL\n%s is not saturated\n", fd.name);
+    exit(1);
+  }
+}
+
+/**
+ * @brief Functions are skipped once they used up their budget
+ * @details the call that reaches MAX_REPORT_INPUTS or MAX_REPORT_CALLS is
+ * still reported, the calls after it are not. The cases are only run if the
+ * budget is set.
+ */
+static void add_budget_cases(vector<TestCase> &cases) {
+  vector<ReportTypeTag> i32 = {tag(RTK_Int, 0, 32)};
+  if (const char *env_p = getenv("MAX_REPORT_INPUTS")) {
+    static uint64_t max_inputs = atoi(env_p);
+    string expected = "[";
+    for (uint64_t in = 0; in < max_inputs; in++) {
+      expected += string(in > 0 ? "," : "") + "[[\"" + to_string(in) +
+                  "\"],[[\"" + to_string(in) + "\"]]]";
+    }
+    cases.push_back({"report_test?input_budget", i32, i32, {},
+                     [](Calls &c) {
+                       for (uint64_t in = 0; in < 2 * max_inputs; in++) {
+                         c.call({in}, {in});
+                       }
+                       check_saturated(c.desc("report_test?input_budget"));
+                     },
+                     expected + "]"});
+  }
+  if (const char *env_p = getenv("MAX_REPORT_CALLS")) {
+    static uint64_t max_calls = atol(env_p);
+    // only the last call within the budget reports a new output
+    cases.push_back({"report_test?call_budget", i32, i32, {},
+                     [](Calls &c) {
+                       for (uint64_t i = 1; i <= 2 * max_calls; i++) {
+                         c.call({0}, {i < max_calls ? 0 : i + 1 - max_calls});
+                       }
+                       check_saturated(c.desc("report_test?call_budget"));
+                     },
+                     "[[[\"0\"],[[\"0\"],[\"1\"]]]]"});
+  }
+}
+
+/**
+ * @brief Values that print the same are the same observation
+ * @details the reporter hashes values before formatting them, the hash must
+ * not tell apart values that only differ below the printed precision
+ */
+static vector<TestCase> value_cases() {
+  return {
+      {"report_test?float_rounding",
+       {tag(RTK_Float, 0, 32), tag(RTK_Double, 0, 64), tag(RTK_Int, 0, 32)},
+       {tag(RTK_Double, 0, 64)},
+       {},
+       [](Calls &c) {
+         // floats are passed as double
+         c.call({to_slot((double)1.5f), to_slot(2.25),
+               to_slot((uint64_t)(uint32_t)-3)},
+              {to_slot(3.0)});
+         c.call({to_slot((double)1.5000001f), to_slot(2.25),
+               to_slot((uint64_t)(uint32_t)-3)},
+              {to_slot(3.0000001)});
+         c.call({to_slot((double)1.5f), to_slot(2.2500001),
+               to_slot((uint64_t)(uint32_t)-3)},
+              {to_slot(3.0)});
+       },
+       "[[[\"1.500000\",\"2.250000\",\"-3\"],[[\"3.000000\"]]]]"},
+      {"report_test?referent_rounding",
+       {tag(RTK_Double, 1, 64), tag(RTK_Float, 1, 32)},
+       {tag(RTK_Int, 0, 32)},
+       {},
+       [](Calls &c) {
+         double d1 = 0.1, d2 = 0.1000000001;
+         float f1 = 0.25f, f2 = 0.2500000001f;
+         c.call({to_slot(&d1), to_slot(&f1)}, {0});
+         c.call({to_slot(&d2), to_slot(&f2)}, {0});
+       },
+       "[[[\"0.100000\",\"0.250000\"],[[\"0\"]]]]"},
+      {"report_test?signed_zero",
+       {tag(RTK_Double, 0, 64)},
+       {tag(RTK_Int, 0, 32)},
+       {},
+       [](Calls &c) {
+         // -0.0 prints with its sign, like negative values rounding to 0
+         c.call({to_slot(0.0)}, {0});
+         c.call({to_slot(1e-9)}, {0});
+         c.call({to_slot(-0.0)}, {0});
+         c.call({to_slot(-1e-9)}, {0});
+       },
+       "[[[\"0.000000\"],[[\"0\"]]],[[\"-0.000000\"],[[\"0\"]]]]"},
+      {"report_test?nan_payload",
+       {tag(RTK_Double, 0, 64), tag(RTK_Double, 1, 64)},
+       {tag(RTK_Double, 0, 64)},
+       {},
+       [](Calls &c) {
+         double nan1 = slot_cast<double>(0x7ff8000000000000ull);
+         double nan2 = slot_cast<double>(0x7ff8000000000123ull);
+         double neg_nan = slot_cast<double>(0xfff8000000000001ull);
+         c.call({to_slot(nan1), to_slot(&nan2)}, {to_slot(nan2)});
+         c.call({to_slot(nan2), to_slot(&nan1)}, {to_slot(nan1)});
+         c.call({to_slot(neg_nan), to_slot(&nan1)}, {to_slot(nan1)});
+       },
+       "[[[\"nan\",\"nan\"],[[\"nan\"]]],"
+       "[[\"-nan\",\"nan\"],[[\"nan\"]]]]"},
+      {"report_test?long_double_padding",
+       {tag(RTK_LongDouble, 1, 80)},
+       {tag(RTK_Int, 0, 32)},
+       {},
+       [](Calls &c) {
+         // the 80-bit value is followed by padding bytes that are not printed
+         long double ld1, ld2;
+         memset(&ld1, 0x00, sizeof(ld1));
+         memset(&ld2, 0xff, sizeof(ld2));
+         ld1 = 2.5L;
+         ld2 = 2.5L;
+         c.call({to_slot(&ld1)}, {0});
+         c.call({to_slot(&ld2)}, {0});
+       },
+       "[[[\"2.500000\"],[[\"0\"]]]]"},
+      {"report_test?deep_padding",
+       {tag(RTK_Struct, 1, 0)},
+       {tag(RTK_Int, 0, 32)},
+       {&node_layout},
+       [](Calls &c) {
+         // the padding after tag is copied with the node but not printed
+         Node n1, n2, n3;
+         memset(&n1, 0x00, sizeof(n1));
+         memset(&n2, 0xff, sizeof(n2));
+         memset(&n3, 0x5a, sizeof(n3));
+         n1 = {7, 1.0, nullptr};
+         n2 = {7, 1.0000000001, nullptr};
+         n3 = {7, 1.0, &n1};
+         c.call({to_slot(&n1)}, {1});
+         c.call({to_slot(&n2)}, {1});
+         c.call({to_slot(&n3)}, {2});
+       },
+       "[[[\"{7, 1.000000, ptr[]}\"],[[\"1\"]]],"
+       "[[\"{7, 1.000000, ptr[{7, 1.000000, ptr[]}]}\"],[[\"2\"]]]]"},
+  };
+}
+
+/**
+ * @brief Convert the trace of a process to a report with trace2json
+ * @return false if the conversion failed
+ */
+static bool convert_trace(const string &dump_file, pid_t pid,
+                          const string &report) {
+  string convert = "./trace2json " + dump_file + "." + to_string(pid) +
+                   ".bin " + report;
+  if (system(convert.c_str()) != 0) {
+    fprintf(stderr, "FAIL\n%s failed\n", convert.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief A forked child reports on its own
+ * @details its observations are not in the report of the parent, with
+ * REPORT_TRACE they are in its own trace and the parent's trace is left
+ * as the parent writes it
+ */
+static void add_fork_cases(vector<TestCase> &cases) {
+  vector<ReportTypeTag> i32 = {tag(RTK_Int, 0, 32)};
+  cases.push_back(
+      {"report_test?forked", i32, i32, {}, [](Calls &c) {
+         // the parent reports before and after the fork
+         c.call(c.desc("report_test?before_fork"), {1}, {2});
+         pid_t pid = fork();
+         if (pid == 0) {
+           c.call({1}, {2});
+           // new outputs of inputs the parent traced
+           c.call(c.desc("report_test?before_fork"), {1}, {3});
+           dump_count();
+           _exit(0);
+         }
+         int status;
+         if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+             !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+           fprintf(stderr, "FAIL\nforked child failed\n");
+           exit(1);
+         }
+         c.call(c.desc("report_test?before_fork"), {1}, {4});
+         const char *dump_file = getenv("DUMP_FILE_NAME");
+         if (!getenv("REPORT_TRACE")) {
+           return;
+         }
+         string report = string(dump_file) + ".child.json";
+         if (!convert_trace(dump_file, pid, report)) {
+           exit(1);
+         }
+         ifstream in(report);
+         stringstream child;
+         child << in.rdbuf();
+         string expected =
+             "[{\"report_test?forked\":[[[\"1\"],[[\"2\"]]]]},"
+             "{\"report_test?before_fork\":[[[\"1\"],[[\"3\"]]]]}]";
+         if (child.str() != expected) {
+           fprintf(stderr, "FAIL\nexpected: %s\nchild:    %s\n",
+                   expected.c_str(), child.str().c_str());
+           exit(1);
+         }
+       }, ""});
+  cases.push_back({"report_test?before_fork", i32, i32, {}, nullptr,
+                   "[[[\"1\"],[[\"2\"],[\"4\"]]]]"});
+}
+
+int main() {
+  const char *dump_file = getenv("DUMP_FILE_NAME");
+  if (!dump_file) {
+    fprintf(stderr, "DUMP_FILE_NAME is not set\n");
+    return 1;
+  }
+
+  vector<TestCase> cases = value_cases();
+  add_shadow_stack_cases(cases);
+  add_budget_cases(cases);
+  add_fork_cases(cases);
+  add_threaded_cases(cases);
+  vector<ReportFuncDesc> descs;
+  for (TestCase &tc : cases) {
+    ReportFuncDesc fd;
+    memset(&fd, 0, sizeof(fd));
+    fd.name = tc.name.c_str();
+    fd.in_tags = tc.in_tags.data();
+    fd.out_tags = tc.out_tags.data();
+    fd.num_in = tc.in_tags.size();
+    fd.num_out = tc.out_tags.size();
+    fd.in_layouts = tc.in_layouts.empty() ? nullptr : tc.in_layouts.data();
+    fd.props = tc.props;
+    fd.id = REPORT_ID_UNREGISTERED;
+    descs.push_back(fd);
+  }
+  report_register_descs(REPORT_DESC_VERSION, descs.data(),
+                        descs.data() + descs.size());
+
+  string expected;
+  for (size_t i = 0; i < cases.size(); i++) {
+    if (cases[i].calls) {
+      Calls calls(descs, &descs[i]);
+      cases[i].calls(calls);
+    }
+    if (!cases[i].expected.empty()) {
+      expected += string(expected.empty() ? "[{\"" : ",{\"") +
+                  cases[i].name + "\":" + cases[i].expected + "}";
+    }
+  }
+  expected += "]";
+
+  dump_count();
+  if (getenv("REPORT_TRACE")) {
+    // the observations are in the trace of this process, convert it
+    if (!convert_trace(dump_file, getpid(), dump_file)) {
+      return 1;
+    }
+  }
+  ifstream in(dump_file);
+  stringstream dumped;
+  dumped << in.rdbuf();
+  if (dumped.str() != expected) {
+    fprintf(stderr, "FAIL\nexpected: %s\ndumped:   %s\n", expected.c_str(),
+            dumped.str().c_str());
+    return 1;
+  }
+  printf("PASS %zu cases\n", cases.size());
+  return 0;
+}
@@ -1,20 +1,38 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <iostream>
 #include <memory>
-#include <nlohmann/json.hpp>
+#include <mutex>
+#include <new>
 #include <regex>
-#include <setjmp.h>
 #include <signal.h>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "ExecHashMap.hpp"
+#include "FastHash.hpp"
+#include "JsonWriter.hpp"
+#include "ReportDesc.h"
+#include "SafeRead.hpp"
+#include "SharedTable.hpp"
+#include "SlotFormat.hpp"
+#include "TraceFile.hpp"
 
 // for convenience
-using json = nlohmann::json;
 using namespace std;
 
 static bool SILENT_REPORTER = false;
@@ -22,6 +40,9 @@ __attribute__((constructor)) static void check_silence() {
   SILENT_REPORTER = (std::getenv("SILENT_REPORTER") != nullptr);
 }
 
+/// @brief Whether capture is enabled, see report_set_enabled
+static std::atomic<bool> CAPTURE_ENABLED(true);
+
 /// @brief The maximum number of output vectors for same input vector
 static int MAX_REPORT_SIZE = 10;
 __attribute__((constructor)) static void check_max_report() {
@@ -33,8 +54,194 @@ __attribute__((constructor)) static void check_max_report() {
   }
 }
 
+/// @brief Report budget of a function, once it reports this many distinct
+/// inputs or calls its calls are no longer captured. 0 means no limit.
+static int MAX_REPORT_INPUTS = 0;
+static long MAX_REPORT_CALLS = 0;
+__attribute__((constructor)) static void check_report_budget() {
+  if (const char *env_p = std::getenv("MAX_REPORT_INPUTS")) {
+    MAX_REPORT_INPUTS = std::max(atoi(env_p), 0);
+  }
+  if (const char *env_p = std::getenv("MAX_REPORT_CALLS")) {
+    MAX_REPORT_CALLS = std::max(atol(env_p), 0L);
+  }
+}
+
+/// @brief Pointers to structs are captured with the graph they point to, up
+/// to REPORT_CAPTURE_DEPTH structs on a path and REPORT_CAPTURE_BYTES copied
+/// bytes per reported call. Depth 0 only captures the first scalar.
+static unsigned REPORT_CAPTURE_DEPTH = 3;
+static size_t REPORT_CAPTURE_BYTES = 256;
+__attribute__((constructor)) static void check_capture_budget() {
+  if (const char *env_p = std::getenv("REPORT_CAPTURE_DEPTH")) {
+    REPORT_CAPTURE_DEPTH = std::max(atoi(env_p), 0);
+  }
+  if (const char *env_p = std::getenv("REPORT_CAPTURE_BYTES")) {
+    REPORT_CAPTURE_BYTES = std::max(atol(env_p), 0L);
+  }
+}
+
+/// @brief Functions the pass found hot (REPORT_PROP_SAMPLED) only capture
+/// every this many calls
+static unsigned REPORT_SAMPLE_PERIOD = 64;
+__attribute__((constructor)) static void check_sample_period() {
+  if (const char *env_p = std::getenv("REPORT_SAMPLE_PERIOD")) {
+    REPORT_SAMPLE_PERIOD = std::max(atoi(env_p), 1);
+  }
+}
+
+/// @brief Append the observations reported since the last flush to
+/// DUMP_FILE_NAME every this many seconds, or once this many new
+/// observations were reported. 0 means the report is only dumped at exit.
+/// A flushed report is NDJSON, so flushing requires REPORT_NDJSON.
+static int REPORT_FLUSH_INTERVAL = 0;
+static long REPORT_FLUSH_OBSERVATIONS = 0;
+__attribute__((constructor)) static void check_flush() {
+  if (const char *env_p = std::getenv("REPORT_FLUSH_INTERVAL")) {
+    REPORT_FLUSH_INTERVAL = std::max(atoi(env_p), 0);
+  }
+  if (const char *env_p = std::getenv("REPORT_FLUSH_OBSERVATIONS")) {
+    REPORT_FLUSH_OBSERVATIONS = std::max(atol(env_p), 0L);
+  }
+  if ((REPORT_FLUSH_INTERVAL > 0 || REPORT_FLUSH_OBSERVATIONS > 0) &&
+      !std::getenv("REPORT_NDJSON")) {
+    fprintf(stderr, "Flushing the report requires REPORT_NDJSON, the report "
+                    "is only dumped at exit\n");
+    REPORT_FLUSH_INTERVAL = 0;
+    REPORT_FLUSH_OBSERVATIONS = 0;
+  }
+}
+
+/// @brief Store observations as raw captures and only format them to strings
+/// when the table is dumped, trades memory for less work in the target
+static bool DEFER_REPORT_FORMAT = false;
+__attribute__((constructor)) static void check_defer_format() {
+  DEFER_REPORT_FORMAT = (std::getenv("DEFER_REPORT_FORMAT") != nullptr);
+}
+
+/// @brief Append new observations to the binary trace
+/// DUMP_FILE_NAME.<pid>.bin instead of keeping them for the JSON dump, see
+/// trace2json
+static bool REPORT_TRACE = false;
+__attribute__((constructor)) static void check_trace() {
+  REPORT_TRACE = (std::getenv("REPORT_TRACE") != nullptr);
+}
+
+/// @brief Dump one JSON object per function and line instead of one array
+static bool REPORT_NDJSON = false;
+__attribute__((constructor)) static void check_ndjson() {
+  REPORT_NDJSON = (std::getenv("REPORT_NDJSON") != nullptr);
+}
+
+/// @brief Number of threads formatting the report at dump, by default one
+/// per core up to 8, and at most MAX_DUMP_THREADS
+static const long MAX_DUMP_THREADS = 64;
+static unsigned REPORT_DUMP_THREADS = 1;
+__attribute__((constructor)) static void check_dump_threads() {
+  REPORT_DUMP_THREADS =
+      std::max(std::min(std::thread::hardware_concurrency(), 8u), 1u);
+  if (const char *env_p = std::getenv("REPORT_DUMP_THREADS")) {
+    char *end;
+    long n = strtol(env_p, &end, 10);
+    if (end == env_p || *end != '\0' || n <= 0) {
+      fprintf(stderr, "Ignoring REPORT_DUMP_THREADS=%s\n", env_p);
+      return;
+    }
+    REPORT_DUMP_THREADS = std::min(n, MAX_DUMP_THREADS);
+  }
+}
+
 static ReportTable report_table(MAX_REPORT_SIZE);
 
+/// @brief With REPORT_DB or REPORT_SHM, the table shared by all processes
+/// of a campaign that replaces report_table, see open_shared_table
+static SharedTable *shared_table = nullptr;
+static char REPORT_SHM[256];
+static const char *REPORT_DB = nullptr;
+
+static void link_registered_funcs();
+
+/**
+ * @brief Open the report database REPORT_DB, or the shared memory region
+ * named by REPORT_SHM
+ * @details the first process creates the table, forked children inherit
+ * the mapping and processes started with the same REPORT_DB or REPORT_SHM
+ * attach to it. The last process reporting to it writes the merged report
+ * at exit, see dump_shared_table. A database keeps its
+ * observations and saturated functions for later runs. REPORT_DB_CAPACITY
+ * and REPORT_SHM_CAPACITY are the number of observations the table holds,
+ * 1048576 and 131072 by default.
+ */
+__attribute__((constructor)) static void open_shared_table() {
+  REPORT_DB = std::getenv("REPORT_DB");
+  const char *name = std::getenv("REPORT_SHM");
+  if ((!REPORT_DB && !name) || SILENT_REPORTER || REPORT_TRACE) {
+    REPORT_DB = nullptr;
+    return;
+  }
+  const char *what = REPORT_DB ? "report database" : "shared report";
+  const char *capacity_var =
+      REPORT_DB ? "REPORT_DB_CAPACITY" : "REPORT_SHM_CAPACITY";
+  uint64_t capacity = REPORT_DB ? 1 << 20 : 1 << 17;
+  const char *capacity_env = std::getenv(capacity_var);
+  if (capacity_env) {
+    capacity = std::max(atol(capacity_env), 1L);
+  }
+  if (!REPORT_DB) {
+    // shm_open names start with a slash
+    snprintf(REPORT_SHM, sizeof(REPORT_SHM), "%s%s",
+             name[0] == '/' ? "" : "/", name);
+  }
+  auto open_table = [&](int flags) {
+    return REPORT_DB ? open(REPORT_DB, flags, 0644)
+                     : shm_open(REPORT_SHM, flags, 0600);
+  };
+
+  SharedTable *table = new SharedTable();
+  int fd = open_table(O_RDWR | O_CREAT | O_EXCL);
+  if (fd >= 0) {
+    if (!table->create(fd, capacity, MAX_REPORT_SIZE)) {
+      fprintf(stderr, "Error creating %s: %s\n", what, strerror(errno));
+      REPORT_DB ? unlink(REPORT_DB) : shm_unlink(REPORT_SHM);
+      close(fd);
+      delete table;
+      return;
+    }
+  } else if (errno == EEXIST && (fd = open_table(O_RDWR)) >= 0) {
+    if (const char *err = table->attach(fd)) {
+      fprintf(stderr, "Error opening %s: %s\n", what, err);
+      close(fd);
+      delete table;
+      return;
+    }
+    // the layout is fixed by the process that created the table
+    if (table->max_outputs() != (uint32_t)MAX_REPORT_SIZE) {
+      fprintf(stderr,
+              "Error opening %s: it keeps %u outputs for the same inputs, "
+              "not MAX_REPORT_SIZE=%d\n",
+              what, table->max_outputs(), MAX_REPORT_SIZE);
+      close(fd);
+      delete table;
+      return;
+    }
+    if (capacity_env && table->capacity() != capacity) {
+      fprintf(stderr, "%s holds %lu observations, ignoring %s=%s\n", what,
+              (unsigned long)table->capacity(), capacity_var, capacity_env);
+    }
+  } else {
+    fprintf(stderr, "Error opening %s: %s\n", what, strerror(errno));
+    delete table;
+    return;
+  }
+  close(fd);
+  shared_table = table;
+  // functions registered before, saturated ones are skipped right away
+  link_registered_funcs();
+}
+
+void write_stored_values(JsonWriter &w, const ValuePool &pool,
+                         uint32_t func_id, bool is_rnt, StoredValues values);
+
 /**
  * @brief Signal handler non-standard exit
  * https://stackoverflow.com/questions/40311937/terminating-a-program-with-calling-atexit-functions-linux
@@ -43,15 +250,39 @@ extern "C" void signal_handler(__attribute__((unused)) const int signum) {
   exit(EXIT_FAILURE);
 }
 
-/**
- * @brief Signal handler for segfault
- */
-static sigjmp_buf env;
-void segfault_handler(int signal_number) { siglongjmp(env, 1); }
+// interposed so pointers into unmapped or protected pages are no longer
+// read from the safe_read page cache
+extern "C" int munmap(void *addr, size_t len) noexcept {
+  safe_read::invalidate(addr, len);
+  return syscall(SYS_munmap, addr, len);
+}
+
+extern "C" int mprotect(void *addr, size_t len, int prot) noexcept {
+  safe_read::invalidate(addr, len);
+  return syscall(SYS_mprotect, addr, len, prot);
+}
+
+extern "C" void *mremap(void *old_addr, size_t old_len, size_t new_len,
+                        int flags, ...) noexcept {
+  void *new_addr = nullptr;
+  if (flags & MREMAP_FIXED) {
+    va_list ap;
+    va_start(ap, flags);
+    new_addr = va_arg(ap, void *);
+    va_end(ap);
+  }
+  safe_read::invalidate(old_addr, old_len);
+  if (new_addr) {
+    safe_read::invalidate(new_addr, new_len);
+  }
+  return (void *)syscall(SYS_mremap, old_addr, old_len, new_len, flags,
+                         new_addr);
+}
 
 // the fuzzer file will be linked to multiple targets
-// for each target, the table should be dumped once
-thread_local unsigned int dump_counter = 0;
+// for each target, the table should be dumped once,
+// even if several threads exit at the same time
+static std::atomic<unsigned int> dump_counter(0);
 
 class DumpFileNameSetter {
 public:
@@ -63,231 +294,1314 @@ public:
 };
 static DumpFileNameSetter dump_file_name_setter;
 
+/// @brief Trace of this process, see trace_writer
+static TraceWriter &trace_file() {
+  static TraceWriter writer;
+  return writer;
+}
+
+// the trace of this process was opened, forked children open their own
+static std::atomic<bool> trace_opened(false);
+static std::mutex trace_open_lock;
+
+static string trace_file_name() {
+  return string(dump_file_name_setter.filename) + "." +
+         std::to_string(getpid()) + ".bin";
+}
+
+/**
+ * @brief Trace the observations are appended to with REPORT_TRACE
+ * @details opened on first use, so each process writes its own trace
+ */
+static TraceWriter &trace_writer() {
+  TraceWriter &writer = trace_file();
+  if (!trace_opened.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> guard(trace_open_lock);
+    if (!trace_opened.load(std::memory_order_relaxed)) {
+      writer.open(trace_file_name().c_str());
+      trace_opened.store(true, std::memory_order_release);
+    }
+  }
+  return writer;
+}
+
+static bool flush_enabled() {
+  return !REPORT_TRACE && !shared_table &&
+         (REPORT_FLUSH_INTERVAL > 0 || REPORT_FLUSH_OBSERVATIONS > 0);
+}
+
+// serializes flushes and the final dump
+static std::mutex flush_lock;
+static std::condition_variable flush_cv;
+// the dump file was started by a flush of this process
+static bool flushed = false;
+// set by the final dump, stops the flusher thread
+static bool flush_stopped = false;
+// new observations since the last flush
+static std::atomic<long> pending_observations(0);
+static std::atomic<bool> flusher_started(false);
+static std::thread *flusher_thread = nullptr;
+
+/**
+ * @brief Append the observations reported since the last flush to the dump
+ * file as NDJSON, flush_lock must be held
+ */
+static void flush_locked() {
+  char *filename = dump_file_name_setter.filename;
+  int fd = open(filename, O_WRONLY | O_CREAT | (flushed ? 0 : O_TRUNC), 0644);
+  if (fd < 0) {
+    perror("Error opening report");
+    return;
+  }
+  lseek(fd, 0, SEEK_END);
+  pending_observations.store(0, std::memory_order_relaxed);
+  if (!report_table.flush_json(fd, REPORT_DUMP_THREADS, write_stored_values)) {
+    perror("Error writing report");
+  }
+  close(fd);
+  flushed = true;
+}
+
+static void flusher_loop() {
+  std::unique_lock<std::mutex> guard(flush_lock);
+  while (!flush_stopped) {
+    flush_cv.wait_for(guard, std::chrono::seconds(REPORT_FLUSH_INTERVAL));
+    if (!flush_stopped) {
+      flush_locked();
+    }
+  }
+}
+
+/**
+ * @brief Flush if REPORT_FLUSH_OBSERVATIONS new observations are pending,
+ * and start the thread flushing every REPORT_FLUSH_INTERVAL seconds
+ * @details called after a reported call returned. The thread is started by
+ * the first report rather than a constructor, fork servers fork before
+ * that and forked children start their own.
+ */
+static void maybe_flush() {
+  if (REPORT_FLUSH_INTERVAL > 0 &&
+      !flusher_started.load(std::memory_order_relaxed) &&
+      !flusher_started.exchange(true)) {
+    flusher_thread = new std::thread(flusher_loop);
+  }
+  if (REPORT_FLUSH_OBSERVATIONS > 0 &&
+      pending_observations.load(std::memory_order_relaxed) >=
+          REPORT_FLUSH_OBSERVATIONS) {
+    // another thread is already flushing otherwise
+    std::unique_lock<std::mutex> guard(flush_lock, std::try_to_lock);
+    if (guard && !flush_stopped) {
+      flush_locked();
+    }
+  }
+}
+
+__attribute__((constructor)) static void reset_flusher_on_fork() {
+  // a child must not inherit flush_lock locked by a flush of the parent,
+  // and the flusher thread is not forked with it
+  pthread_atfork([] { flush_lock.lock(); }, [] { flush_lock.unlock(); },
+                 [] {
+                   flush_lock.unlock();
+                   flusher_started = false;
+                   flusher_thread = nullptr;
+                 });
+}
+
+/**
+ * @brief Write the report merged from all processes sharing the table
+ * @details the last process leaving the region writes it, the others'
+ * observations are already in the region. If another process publishes
+ * values while the report is written and leaves meanwhile, the report is
+ * written again. The region is kept, later processes add to it and write
+ * the report again when they leave.
+ */
+static void dump_shared_table() {
+  shared_table->leave();
+  const char *table_name = REPORT_DB ? REPORT_DB : REPORT_SHM;
+  char *filename = dump_file_name_setter.filename;
+  uint64_t generation;
+  do {
+    if (shared_table->others_alive() ||
+        !shared_table->begin_write(generation)) {
+      return;
+    }
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror("Error opening report");
+      shared_table->end_write(0);
+      return;
+    }
+    cout << "Dumping shared ReportTable " << table_name << " to " << filename
+         << "\n";
+    if (uint64_t dropped = shared_table->dropped()) {
+      fprintf(stderr, "%lu observations did not fit into %s\n",
+              (unsigned long)dropped, table_name);
+    }
+    if (!shared_table->write_json(fd, REPORT_NDJSON)) {
+      perror("Error writing report");
+    }
+    close(fd);
+  } while (shared_table->end_write(generation));
+}
+
 extern "C" void dump_count() {
   if (SILENT_REPORTER)
     return;
-  if (dump_counter > 0) {
+  if (dump_counter.fetch_add(1) > 0) {
+    return;
+  }
+  if (REPORT_TRACE) {
+    // the observations are already in the trace, if any were found
+    if (trace_opened) {
+      cout << "Closing trace " << trace_file_name() << "\n";
+      trace_file().close();
+    }
+    return;
+  }
+  if (shared_table) {
+    dump_shared_table();
+    return;
+  }
+  if (flush_enabled()) {
+    // the rest of the observations are flushed as well
+    std::thread *flusher;
+    {
+      std::lock_guard<std::mutex> guard(flush_lock);
+      flush_stopped = true;
+      cout << "Flushing ReportTable to " << dump_file_name_setter.filename
+           << "\n";
+      flush_locked();
+      flusher = flusher_thread;
+    }
+    flush_cv.notify_all();
+    if (flusher) {
+      flusher->join();
+    }
     return;
   }
-  json j = report_table.to_json();
-  // write j to file set in `dump_fname_name`
+  // write the table to file set in `dump_fname_name`
   char *filename = dump_file_name_setter.filename;
-  FILE *fp = fopen(filename, "w");
-  if (!fp) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
     printf("Error opening file!\n");
     exit(1);
   }
 
   cout << "Dumping ReportTable to " << filename << "\n";
-  fprintf(fp, "%s", j.dump().c_str());
-  fclose(fp);
-  dump_counter++;
+  if (!report_table.write_json(fd, REPORT_NDJSON, REPORT_DUMP_THREADS,
+                               write_stored_values)) {
+    perror("Error writing report");
+  }
+  close(fd);
+
+  // the table is dumped once, release its values in bulk
+  report_table.clear();
 }
 
-vector<string> parse_meta(string meta) {
-  vector<string> xs;
-  string delimiter = ">>=";
+/**
+ * @brief Everything the hot path needs to know about a function
+ */
+struct FuncInfo {
+  string name;
+  vector<SlotInfo> inputs;
+  vector<SlotInfo> outputs;
+  ReportFuncDesc *desc = nullptr;
+  // number of reported calls, checked against MAX_REPORT_CALLS
+  std::atomic<long> calls{0};
+  // number of entries of a sampled function, see REPORT_SAMPLE_PERIOD
+  std::atomic<unsigned> entries{0};
+  // set once the function is written to the trace
+  std::atomic<bool> traced{false};
+  // number of TRACE_INPUT records written for the function
+  std::atomic<int> traced_inputs{0};
+  // entry of the function in shared_table, set by its first report
+  std::atomic<SharedFunc *> shared{nullptr};
+};
+
+/**
+ * @brief Functions of all registered modules, indexed by function ID
+ * @details entries are allocated in chunks and never move, so instrumented
+ * threads look them up without locking while a module loaded with dlopen
+ * registers its functions
+ */
+class FuncRegistry {
+private:
+  static const uint32_t CHUNK_BITS = 12;
+  static const uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+  static const uint32_t MAX_CHUNKS = 4096;
+
+  FuncInfo *chunks[MAX_CHUNKS];
+  std::atomic<uint32_t> count;
+  std::mutex register_lock;
+
+public:
+  FuncRegistry() : chunks(), count(0) {}
+
+  /// @brief Number of registered functions
+  uint32_t size() const { return count.load(std::memory_order_acquire); }
+
+  /// @brief Get a registered function, or null if the ID is out of range
+  FuncInfo *find(uint32_t id) {
+    if (id >= count.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+  }
+
+  /// @brief Call f with every registered function, excluding registration
+  template <typename F> void for_each(F f) {
+    std::lock_guard<std::mutex> guard(register_lock);
+    uint32_t n = count.load(std::memory_order_relaxed);
+    for (uint32_t id = 0; id < n; id++) {
+      f(chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)]);
+    }
+  }
 
-  size_t pos = 0;
-  string token;
-  // TODO: substr is also expensive.
-  while ((pos = meta.find(delimiter)) != string::npos) {
-    token = meta.substr(0, pos);
-    xs.push_back(token);
-    meta.erase(0, pos + delimiter.length());
+  /**
+   * @brief Register the functions of a descriptor section
+   * @param fill: called with each descriptor and its new FuncInfo
+   */
+  template <typename Fill>
+  void add(ReportFuncDesc *begin, ReportFuncDesc *end, Fill fill) {
+    std::lock_guard<std::mutex> guard(register_lock);
+    for (ReportFuncDesc *fd = begin; fd < end; fd++) {
+      uint32_t id = count.load(std::memory_order_relaxed);
+      if ((id >> CHUNK_BITS) >= MAX_CHUNKS) {
+        fprintf(stderr, "Too many instrumented functions\n");
+        return;
+      }
+      FuncInfo *&chunk = chunks[id >> CHUNK_BITS];
+      if (!chunk) {
+        chunk = new FuncInfo[CHUNK_SIZE];
+      }
+      fill(fd, chunk[id & (CHUNK_SIZE - 1)]);
+      fd->id = id;
+      count.store(id + 1, std::memory_order_release);
+    }
   }
-  return xs;
+};
+
+static FuncRegistry &func_registry() {
+  // constructed on first use, module constructors may run before ours
+  static FuncRegistry registry;
+  return registry;
 }
 
-const vector<string> FLOAT_TYPES = {"half",  "bfloat",   "float",    "double",
-                                    "fp128", "x86_fp80", "ppc_fp128"};
+/**
+ * @brief Get the entry of a function in shared_table, adding it on first use
+ * @details a function saturated in an earlier run or another process is
+ * marked saturated here, so its calls are skipped from now on
+ * @return the entry, or null if the table is full
+ */
+static SharedFunc *link_shared_func(FuncInfo &func) {
+  SharedFunc *shared = func.shared.load(std::memory_order_acquire);
+  if (shared) {
+    return shared;
+  }
+  shared = shared_table->func(func.desc->id, func.name);
+  if (!shared) {
+    return nullptr;
+  }
+  func.shared.store(shared, std::memory_order_release);
+  if (shared->flags.load(std::memory_order_relaxed) & SHARED_FUNC_SATURATED) {
+    __atomic_fetch_or(&func.desc->flags, REPORT_FLAG_SATURATED,
+                      __ATOMIC_RELAXED);
+  }
+  return shared;
+}
 
-bool is_int(string type) {
-  return type[0] == 'i' && type.find("*") == string::npos;
+static void link_registered_funcs() {
+  FuncRegistry &registry = func_registry();
+  for (uint32_t id = 0; id < registry.size(); id++) {
+    link_shared_func(*registry.find(id));
+  }
 }
 
-bool is_float(string type) {
-  return find(FLOAT_TYPES.begin(), FLOAT_TYPES.end(), type) !=
-         FLOAT_TYPES.end();
+/**
+ * @brief Register the function descriptors of an instrumented binary
+ * @details called from a constructor emitted by the pass in every
+ * instrumented module, modules linked into the same executable or shared
+ * library pass the same section and it is only registered once
+ * @param version: REPORT_DESC_VERSION the pass was built with
+ * @param begin: start of the descriptor section
+ * @param end: end of the descriptor section
+ */
+extern "C" void report_register_descs(uint32_t version, ReportFuncDesc *begin,
+                                      ReportFuncDesc *end) {
+  if (version != REPORT_DESC_VERSION) {
+    fprintf(stderr, "Report descriptor version %u is not supported\n",
+            version);
+    return;
+  }
+  // already registered by another module of the same binary
+  if (!begin || begin == end || begin->id != REPORT_ID_UNREGISTERED) {
+    return;
+  }
+
+  // the registration constructors run before ours
+  check_silence();
+  func_registry().add(begin, end, [](ReportFuncDesc *fd, FuncInfo &func) {
+    func.name = fd->name;
+    func.inputs = decode_slots(fd->in_tags, fd->num_in, fd->in_types,
+                               fd->in_layouts);
+    func.outputs = decode_slots(fd->out_tags, fd->num_out, fd->out_types,
+                                fd->out_layouts);
+    func.desc = fd;
+    if (SILENT_REPORTER || !CAPTURE_ENABLED.load(std::memory_order_relaxed)) {
+      fd->flags |= REPORT_FLAG_DISABLED;
+    }
+  });
+  if (shared_table) {
+    link_registered_funcs();
+  }
+}
+
+extern "C" void report_set_enabled(int enabled) {
+  if (SILENT_REPORTER) {
+    return;
+  }
+  // functions registered concurrently see the new state, or are updated
+  // below as registration holds the same lock
+  CAPTURE_ENABLED.store(enabled, std::memory_order_relaxed);
+  func_registry().for_each([enabled](FuncInfo &func) {
+    if (enabled) {
+      __atomic_fetch_and(&func.desc->flags, ~REPORT_FLAG_DISABLED,
+                         __ATOMIC_RELAXED);
+    } else {
+      __atomic_fetch_or(&func.desc->flags, REPORT_FLAG_DISABLED,
+                        __ATOMIC_RELAXED);
+    }
+  });
 }
 
-bool is_pointer_ty(string type) { return type.back() == '*'; }
+// deep captures of the current report call, see append_deep_captures
+static thread_local vector<unsigned char> deep_scratch;
 
 /**
- * todo: support struct
- * https://llvm.org/docs/LangRef.html#structure-type
- * @brief Check if a type is a struct
- * @param type: type to check
- * @return true if the type is a struct
+ * @brief Depth-first walk of the pointer graph of a reported value
+ * @details copies the nodes to deep_scratch as DeepNodeStates followed by
+ * the node's bytes, nothing is formatted or hashed, see hash_deep. Nodes
+ * already visited by the same value are recorded as cycles.
  */
-bool is_struct(string type) { return false; }
+class DeepWalker {
+private:
+  static const unsigned MAX_NODES = 32;
+  const void *visited[MAX_NODES];
+  unsigned num_visited;
+  size_t &budget;
 
-void *dereferenceNTimes(void **ptr, int n) {
-  void *pp;
-  for (int i = 0; i < n; i++) {
-    pp = reinterpret_cast<void *>(*ptr);
-    if (!pp) {
-      return nullptr;
+public:
+  /// @param budget: bytes left to copy, shared by the values of a call
+  DeepWalker(size_t &budget) : num_visited(0), budget(budget) {}
+
+  /**
+   * @param ptr: pointer to the node
+   * @param layout: layout of a struct node, null for a scalar node
+   * @param tag: tag of the pointer to a scalar node
+   * @param depth: number of nodes above this one
+   */
+  void walk(const void *ptr, const ReportTypeLayout *layout, ReportTypeTag tag,
+            unsigned depth) {
+    if (!ptr) {
+      deep_scratch.push_back(DEEP_NULL);
+      return;
+    }
+    for (unsigned i = 0; i < num_visited; i++) {
+      if (visited[i] == ptr) {
+        deep_scratch.push_back(DEEP_CYCLE);
+        return;
+      }
+    }
+    unsigned size =
+        layout ? layout->size : field_node_size(ReportFieldDesc{0, tag, 0});
+    if (depth >= REPORT_CAPTURE_DEPTH || size > budget ||
+        num_visited == MAX_NODES) {
+      deep_scratch.push_back(DEEP_CUT);
+      return;
+    }
+
+    size_t at = deep_scratch.size();
+    deep_scratch.resize(at + 1 + size);
+    if (!safe_read::read(&deep_scratch[at + 1], ptr, size)) {
+      deep_scratch.resize(at);
+      deep_scratch.push_back(DEEP_FAULT);
+      return;
+    }
+    deep_scratch[at] = DEEP_NODE;
+    budget -= size;
+    visited[num_visited++] = ptr;
+    if (!layout) {
+      return;
+    }
+
+    for (uint32_t i = 0; i < layout->num_fields; i++) {
+      const ReportFieldDesc &field = layout->fields[i];
+      if (report_tag_ptr_level(field.tag) == 0) {
+        continue;
+      }
+      // the scratch moves while the children are appended
+      const void *child;
+      memcpy(&child, &deep_scratch[at + 1 + field.offset], sizeof(child));
+      if (field_node_size(field) > 0) {
+        walk(child, field.layout, field.tag, depth + 1);
+      }
+    }
+  }
+};
+
+/**
+ * @brief Store the deep captures of a call behind its captures
+ * @details the captures' deep_offset are made relative to the captures, so
+ * the captures and the bytes following them can be copied as one block
+ * @param buf: buffer whose last len captures were filled by capture_slots
+ */
+void append_deep_captures(vector<SlotCapture> &buf, size_t len) {
+  if (deep_scratch.empty()) {
+    return;
+  }
+  size_t first = buf.size() - len;
+  size_t chunk = buf.size();
+  buf.resize(chunk + (deep_scratch.size() + sizeof(SlotCapture) - 1) /
+                         sizeof(SlotCapture));
+  memcpy((void *)&buf[chunk], deep_scratch.data(), deep_scratch.size());
+  for (size_t i = first; i < chunk; i++) {
+    if (buf[i].deep_len > 0) {
+      buf[i].deep_offset += (chunk - i) * sizeof(SlotCapture);
     }
   }
-  return pp;
 }
 
 /**
- * @brief Convert a single-level reference pointer to a string of its referent
- * @param ptr: pointer to the referent casted to void*
- * @param base_type: base type of the pointer
- * @return string representation of the referent
+ * @brief Size of captures and the deep captures stored behind them
  */
-string to_string_ptr(void *ptr, string base_type) {
+size_t captures_size(const SlotCapture *captures, size_t len) {
+  size_t size = len * sizeof(SlotCapture);
+  for (size_t i = 0; i < len; i++) {
+    if (captures[i].deep_len > 0) {
+      size = std::max(size, i * sizeof(SlotCapture) + captures[i].deep_offset +
+                                captures[i].deep_len);
+    }
+  }
+  return size;
+}
+
+/**
+ * @brief Capture a reported value, copying the referent of pointers
+ * @details the graph behind a pointer to a struct is copied to deep_scratch
+ * @param raw: raw value, see slot_cast
+ * @param slot: decoded type of the value
+ * @param c: capture to fill
+ * @param budget: bytes deep captures of the call may still copy
+ */
+void capture_slot(uint64_t raw, const SlotInfo &slot, SlotCapture &c,
+                  size_t &budget) {
+  c.raw = raw;
+  c.state = CAPTURE_VALUE;
+  c.deep_len = 0;
+  if (slot.ptr_level == 0 || slot.kind == RTK_Func) {
+    return;
+  }
+
+  void *ptr = slot_cast<void *>(raw);
   if (!ptr) {
-    return string("ptr[]");
+    c.state = CAPTURE_NULL;
+    return;
   }
-  string val;
 
-  if (base_type == "void") {
-    return "ptr[]: void";
-  } else if (is_int(base_type)) {
-    // * Integer Type
-    int size = atoi(base_type.substr(1).c_str());
-    if (size <= 32) {
-      val = to_string(*(int *)ptr);
-    } else {
-      val = to_string(*(long *)ptr);
-    }
-  } else if (is_float(base_type)) {
-    // * Floating-Point Types
-    auto it = find(FLOAT_TYPES.begin(), FLOAT_TYPES.end(), base_type);
-    int fp_idx = it - FLOAT_TYPES.begin();
-    if (fp_idx < 3) {
-      val = to_string(*(float *)ptr);
-    } else if (fp_idx == 3) {
-      val = to_string(*(double *)ptr);
-    } else {
-      val = to_string(*(long double *)ptr);
+  // there are some cases that the reported pointer is invalid,
+  // it is only read through safe_read so the target does not crash
+  for (unsigned level = 1; level < slot.ptr_level; level++) {
+    if (!safe_read::read_value(ptr, ptr)) {
+      c.state = CAPTURE_FAULT;
+      return;
     }
-  } else {
-    // add type name to error message
-    // todo: support these common types
-    return "ptr[]: " + base_type;
+    if (!ptr) {
+      c.state = CAPTURE_INNER_NULL;
+      return;
+    }
+  }
+  if (slot.layout && REPORT_CAPTURE_DEPTH > 0) {
+    size_t start = deep_scratch.size();
+    DeepWalker(budget).walk(ptr, slot.layout, 0, 0);
+    c.deep_offset = start;
+    c.deep_len = deep_scratch.size() - start;
+    return;
+  }
+  if (!safe_read::read(c.referent, ptr, slot.referent_size)) {
+    c.state = CAPTURE_FAULT;
   }
-  return val;
 }
 
 /**
- * @brief Convert a multi-level reference pointer to a string of its referent
- * @param ptr: pointer to the referent casted to void**
- * @param base_type: base type of the pointer
- * @param ptr_level: number of levels of reference (e.g. int** is ptr_level=2)
- * @return string representation of the referent
+ * @brief Fold a floating-point value into a hash as the string
+ * std::to_string prints for it
+ * @details "%f" rounds to 6 decimals, so values that only differ below them
+ * and NaNs of any payload print the same and have to hash the same
  */
-string to_string_ptr(void **ptr, string base_type, int ptr_level) {
-  if (!ptr) {
-    return string("ptr[]");
+template <typename T>
+uint64_t hash_printed_float(uint64_t h, T v, const char *format) {
+  char buf[64];
+  int len = snprintf(buf, sizeof(buf), format, v);
+  if (len >= (int)sizeof(buf)) {
+    std::string str = std::to_string(v);
+    return fast_hash_bytes(h, str.data(), str.size());
   }
-  string val = "";
-  void *deref_ptr = dereferenceNTimes(ptr, ptr_level);
-  return "ptr[" + to_string_ptr(deref_ptr, base_type) + "]";
+  return fast_hash_bytes(h, buf, len);
 }
 
-// current reporting IOPair
-thread_local IOPair current_reporting;
-void update_current_reporting(bool is_rnt, const vector<string> &vs,
-                              const string &func_name) {
-  if (is_rnt) {
-    current_reporting.second = vs;
-    report_table.report(func_name, current_reporting);
-  } else {
-    current_reporting.first = vs;
+/**
+ * @brief hash_printed_float of a double without calling snprintf
+ * @details prints the value rounded to millionths like "%f" does, which is
+ * exact as long as the millionths fit in the 52 bits of the mantissa:
+ * fma gives the error of the scaled value, which only matters for ties
+ */
+uint64_t hash_printed_double(uint64_t h, double v) {
+  double scaled = v * 1e6;
+  if (!(std::fabs(scaled) < 0x1p52)) {
+    return hash_printed_float(h, v, "%f");
   }
+  double err = std::fma(v, 1e6, -scaled);
+  // the current rounding mode is to nearest even, like printf's
+  double rounded = std::nearbyint(scaled);
+  double frac = scaled - rounded;
+  if (frac == 0.5 && err > 0) {
+    rounded += 1;
+  } else if (frac == -0.5 && err < 0) {
+    rounded -= 1;
+  }
+
+  uint64_t millionths = (uint64_t)std::fabs(rounded);
+  char buf[32];
+  char *p = buf + sizeof(buf);
+  for (int i = 0; i < 6; i++) {
+    *--p = '0' + millionths % 10;
+    millionths /= 10;
+  }
+  *--p = '.';
+  do {
+    *--p = '0' + millionths % 10;
+    millionths /= 10;
+  } while (millionths > 0);
+  if (std::signbit(v)) {
+    *--p = '-';
+  }
+  return fast_hash_bytes(h, p, buf + sizeof(buf) - p);
 }
 
-extern "C" int report_param(bool is_rnt, const char *param_meta, int len...) {
-  if (SILENT_REPORTER)
+inline bool is_float_kind(unsigned kind) {
+  return kind == RTK_Float || kind == RTK_Double || kind == RTK_FP128 ||
+         kind == RTK_LongDouble;
+}
+
+/**
+ * @brief Fold the referent of a pointer into a hash as to_string_ptr
+ * prints it
+ */
+uint64_t hash_referent(uint64_t h, const SlotCapture &c, const SlotInfo &slot) {
+  switch (slot.kind) {
+  case RTK_Float: {
+    float f;
+    memcpy(&f, c.referent, sizeof(f));
+    return hash_printed_double(h, f);
+  }
+  case RTK_Double: {
+    double d;
+    memcpy(&d, c.referent, sizeof(d));
+    return hash_printed_double(h, d);
+  }
+  case RTK_FP128:
+  case RTK_LongDouble: {
+    long double d;
+    memcpy(&d, c.referent, sizeof(d));
+    return hash_printed_float(h, d, "%Lf");
+  }
+  default:
+    return fast_hash_bytes(h, c.referent, slot.referent_size);
+  }
+}
+
+/**
+ * @brief Fold a scalar stored at p into a hash as format_scalar prints it
+ */
+uint64_t hash_scalar(uint64_t h, const unsigned char *p, ReportTypeTag tag) {
+  unsigned bits = report_tag_bits(tag);
+  switch (report_tag_kind(tag)) {
+  case RTK_Int: {
+    if (bits == 1) {
+      return fast_hash_u64(h, *p & 1);
+    }
+    unsigned bytes = bits <= 8 ? 1 : bits <= 16 ? 2 : bits <= 32 ? 4 : 8;
+    uint64_t v = 0;
+    memcpy(&v, p, bytes);
+    int shift = 64 - bytes * 8;
+    return fast_hash_u64(h, (uint64_t)((int64_t)(v << shift) >> shift));
+  }
+  case RTK_Float: {
+    float f;
+    memcpy(&f, p, sizeof(f));
+    return hash_printed_double(h, f);
+  }
+  case RTK_Double: {
+    double d;
+    memcpy(&d, p, sizeof(d));
+    return hash_printed_double(h, d);
+  }
+  case RTK_FP128:
+  case RTK_LongDouble: {
+    long double d;
+    memcpy(&d, p, sizeof(d));
+    return hash_printed_float(h, d, "%Lf");
+  }
+  default:
+    return h;
+  }
+}
+
+/**
+ * @brief Fold the node of a deep capture at p and its children into a hash
+ * @details walks the capture like format_deep and only hashes the fields it
+ * prints, so padding and array bytes of the copied nodes are left out
+ * @param p: position in the capture, advanced past the node
+ */
+uint64_t hash_deep(uint64_t h, const unsigned char *&p,
+                   const unsigned char *end, const ReportTypeLayout *layout,
+                   ReportTypeTag tag) {
+  if (p >= end) {
+    return fast_hash_u64(h, DEEP_CUT);
+  }
+  unsigned char state = *p++;
+  h = fast_hash_u64(h, state);
+  if (state != DEEP_NODE) {
+    return h;
+  }
+
+  const unsigned char *node = p;
+  if (!layout) {
+    p += field_node_size(ReportFieldDesc{0, tag, nullptr});
+    return hash_scalar(h, node, tag);
+  }
+  p += layout->size;
+  for (uint32_t i = 0; i < layout->num_fields; i++) {
+    const ReportFieldDesc &field = layout->fields[i];
+    if (report_tag_ptr_level(field.tag) == 0) {
+      h = hash_scalar(h, node + field.offset, field.tag);
+    } else if (field_node_size(field) > 0) {
+      h = hash_deep(h, p, end, field.layout, field.tag);
+    }
+  }
+  return h;
+}
+
+/**
+ * @brief Fold a captured value into a hash
+ * @details only what ends up in the value's string is hashed, e.g. the
+ * referent of a pointer but not its address, and values that print the same
+ * hash the same
+ * @param deep: bytes the capture's deep_offset refers to
+ */
+uint64_t hash_capture(uint64_t h, const SlotCapture &c, const SlotInfo &slot,
+                      const unsigned char *deep) {
+  if (slot.kind == RTK_Func) {
+    return h;
+  }
+  if (slot.ptr_level == 0) {
+    if (is_float_kind(slot.kind)) {
+      // passed as double, see format_value<RTK_Double>
+      return hash_printed_double(h, slot_cast<double>(c.raw));
+    }
+    return fast_hash_u64(h, c.raw);
+  }
+  h = fast_hash_u64(h, c.state);
+  if (c.deep_len > 0) {
+    const unsigned char *p = deep + c.deep_offset;
+    h = hash_deep(h, p, p + c.deep_len, slot.layout, 0);
+  } else if (c.state == CAPTURE_VALUE) {
+    h = hash_referent(h, c, slot);
+  }
+  return h;
+}
+
+/**
+ * @brief Inputs traced recently with the hashes of their traced outputs, so
+ * repeated calls are not traced again
+ * @details with REPORT_TRACE the observations are not kept in report_table,
+ * this direct-mapped cache takes its place. It holds NUM_SLOTS inputs with
+ * up to MAX_REPORT_SIZE outputs each, however many observations a run
+ * finds. Inputs evicted from it are traced again with their outputs when
+ * they are seen again, trace2json drops the copies.
+ */
+class TraceFilter {
+private:
+  static const size_t NUM_SLOTS = 4096;
+  static const size_t NUM_LOCKS = 64;
+
+  struct Slot {
+    // hash of the function and the inputs, 0 if the slot is empty
+    uint64_t input_ref;
+    uint32_t num_outputs;
+  };
+  size_t max_outputs;
+  vector<Slot> slots;
+  // max_outputs hashes per slot
+  vector<uint64_t> outputs;
+  // slot i is guarded by locks[i % NUM_LOCKS]
+  std::mutex locks[NUM_LOCKS];
+
+public:
+  TraceFilter(size_t max_outputs)
+      : max_outputs(max_outputs), slots(NUM_SLOTS),
+        outputs(NUM_SLOTS * max_outputs) {
+    clear();
+  }
+
+  /// @brief Forget all inputs, the slots must not be locked by others
+  void clear() {
+    for (Slot &slot : slots) {
+      slot = Slot{0, 0};
+    }
+  }
+
+  /**
+   * @brief Trace an observation unless it was traced recently, or
+   * max_outputs outputs of its inputs were
+   * @details trace is called with the slot locked, so the records of the
+   * same inputs are traced in the order they are found
+   * @param input_ref: hash of the function and the inputs, not 0
+   * @param output_hash: hash of the outputs
+   * @param trace: called as trace(new_inputs), new_inputs is set if the
+   * inputs were not traced recently
+   */
+  template <typename Trace>
+  void add(uint64_t input_ref, uint64_t output_hash, Trace trace) {
+    size_t i = input_ref % NUM_SLOTS;
+    std::lock_guard<std::mutex> guard(locks[i % NUM_LOCKS]);
+    Slot &slot = slots[i];
+    bool new_inputs = slot.input_ref != input_ref;
+    if (new_inputs) {
+      slot = Slot{input_ref, 0};
+    }
+    uint64_t *hashes = &outputs[i * max_outputs];
+    if (slot.num_outputs >= max_outputs ||
+        std::find(hashes, hashes + slot.num_outputs, output_hash) !=
+            hashes + slot.num_outputs) {
+      return;
+    }
+    hashes[slot.num_outputs++] = output_hash;
+    trace(new_inputs);
+  }
+
+  /**
+   * @brief Forget all inputs in a forked child, whose slots may have been
+   * locked by other threads of the parent
+   */
+  void reset_after_fork() {
+    for (std::mutex &lock : locks) {
+      new (&lock) std::mutex();
+    }
+    clear();
+  }
+};
+
+static TraceFilter &trace_filter() {
+  static TraceFilter filter(MAX_REPORT_SIZE);
+  return filter;
+}
+
+// inputs traced so far, only kept to count the distinct inputs of functions
+// against MAX_REPORT_INPUTS, which bounds their number
+static std::mutex traced_inputs_lock;
+static std::unordered_set<uint64_t> traced_inputs;
+
+// IDs of the layouts written to the trace, from 1
+static std::mutex trace_layouts_lock;
+static std::unordered_map<const ReportTypeLayout *, uint32_t> trace_layout_ids;
+
+/**
+ * @brief Write the TRACE_LAYOUT records of a layout and of the layouts its
+ * fields point to, once, trace_layouts_lock must be held
+ * @return ID of the layout in the trace, 0 for none
+ */
+static uint32_t trace_layout(const ReportTypeLayout *layout) {
+  if (!layout) {
     return 0;
-  va_list args;
-  va_start(args, len);
-  vector<string> meta_vec = parse_meta(string(param_meta));
-  string func_name = meta_vec[0];
-  // TODO: Remove this copy constructor and manually calculate offset. Copying
-  // can be expensive.
-  vector<string> types = vector<string>(meta_vec.begin() + 1, meta_vec.end());
-
-  // parse inputs
-  string param = "";
-  vector<string> vs{};
-
-  struct sigaction sa;
-  sa.sa_handler = segfault_handler;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  sigaction(SIGSEGV, &sa, nullptr);
-
-  for (int i = 0; i < len; i++) {
-
-    // NOTE: smaller types will be promoted to larger int/float/long/etc.
-    bool is_val_ptr = false;
-
-    if (is_int(types[i])) {
-      // * Integer Type
-      int size = atoi(types[i].substr(1).c_str());
-      if (size <= 32) {
-        param = to_string(va_arg(args, int));
-      } else {
-        param = to_string(va_arg(args, long));
-      }
-    } else if (is_float(types[i])) {
-      // * Floating-Point Types
-      auto it = find(FLOAT_TYPES.begin(), FLOAT_TYPES.end(), types[i]);
-      int fp_idx = it - FLOAT_TYPES.begin();
-      if (fp_idx <= 4) {
-        param = to_string(va_arg(args, double));
-      } else {
-        param = to_string(va_arg(args, long double));
-      }
-    } else if (types[i].find('(') != string::npos) {
-      // * Function Type
-      param = "func_pointer";
-    } else if (is_pointer_ty(types[i])) {
-      // * Pointer Type
-      // i32**: base_type = i32, ptr_level = 2
-      string base_type = "";
-      int ptr_level = 0;
-      for (char c : types[i]) {
-        if (c == '*') {
-          ptr_level++;
-        } else {
-          base_type += c;
+  }
+  auto found = trace_layout_ids.find(layout);
+  if (found != trace_layout_ids.end()) {
+    return found->second;
+  }
+  TraceLayout tl;
+  tl.layout_id = trace_layout_ids.size() + 1;
+  tl.size = layout->size;
+  tl.num_fields = layout->num_fields;
+  tl.name_len = strlen(layout->name);
+  // the ID is known before the fields, which may point back to the layout
+  trace_layout_ids[layout] = tl.layout_id;
+  vector<TraceField> fields(tl.num_fields);
+  for (uint32_t i = 0; i < tl.num_fields; i++) {
+    const ReportFieldDesc &field = layout->fields[i];
+    fields[i] = TraceField{field.offset, field.tag, trace_layout(field.layout)};
+  }
+  size_t fields_size = fields.size() * sizeof(TraceField);
+  trace_writer().append(TRACE_LAYOUT, sizeof(tl) + fields_size + tl.name_len,
+                        [&](char *p) {
+                          memcpy(p, &tl, sizeof(tl));
+                          p += sizeof(tl);
+                          memcpy(p, fields.data(), fields_size);
+                          p += fields_size;
+                          memcpy(p, layout->name, tl.name_len);
+                        });
+  return tl.layout_id;
+}
+
+__attribute__((constructor)) static void reset_trace_on_fork() {
+  // a child writes its own trace, with its own records of the functions,
+  // layouts and inputs, and must not inherit the locks held by other threads
+  pthread_atfork(
+      [] {
+        if (REPORT_TRACE) {
+          traced_inputs_lock.lock();
+          trace_layouts_lock.lock();
+          trace_open_lock.lock();
+          trace_file().lock_for_fork();
+        }
+      },
+      [] {
+        if (REPORT_TRACE) {
+          trace_file().unlock_after_fork();
+          trace_open_lock.unlock();
+          trace_layouts_lock.unlock();
+          traced_inputs_lock.unlock();
         }
+      },
+      [] {
+        if (REPORT_TRACE) {
+          trace_file().drop_inherited();
+          trace_opened = false;
+          trace_open_lock.unlock();
+          trace_layout_ids.clear();
+          trace_layouts_lock.unlock();
+          traced_inputs.clear();
+          traced_inputs_lock.unlock();
+          trace_filter().reset_after_fork();
+          // the child is single-threaded, registration cannot race
+          FuncRegistry &registry = func_registry();
+          for (uint32_t id = 0; id < registry.size(); id++) {
+            registry.find(id)->traced = false;
+            registry.find(id)->traced_inputs = 0;
+          }
+        }
+      });
+}
+
+/**
+ * @brief Write the TRACE_FUNC record of a function, once
+ * @details preceded by the TRACE_LAYOUT records of its values
+ */
+void trace_func(FuncInfo &func) {
+  if (func.traced.exchange(true)) {
+    return;
+  }
+  const ReportFuncDesc *desc = func.desc;
+  vector<uint32_t> layout_ids;
+  {
+    std::lock_guard<std::mutex> guard(trace_layouts_lock);
+    for (const vector<SlotInfo> *slots : {&func.inputs, &func.outputs}) {
+      for (const SlotInfo &slot : *slots) {
+        layout_ids.push_back(trace_layout(slot.layout));
       }
+    }
+  }
+  TraceFunc tf;
+  tf.func_id = desc->id;
+  tf.num_in = desc->num_in;
+  tf.num_out = desc->num_out;
+  tf.name_len = strlen(desc->name);
+  tf.in_types_len = desc->in_types ? strlen(desc->in_types) : 0;
+  tf.out_types_len = desc->out_types ? strlen(desc->out_types) : 0;
+  size_t tags_size = (tf.num_in + tf.num_out) * sizeof(ReportTypeTag);
+  size_t ids_size = layout_ids.size() * sizeof(uint32_t);
+  size_t size = sizeof(tf) + tags_size + ids_size + tf.name_len +
+                tf.in_types_len + tf.out_types_len;
+  trace_writer().append(TRACE_FUNC, size, [&](char *p) {
+    memcpy(p, &tf, sizeof(tf));
+    p += sizeof(tf);
+    memcpy(p, desc->in_tags, tf.num_in * sizeof(ReportTypeTag));
+    p += tf.num_in * sizeof(ReportTypeTag);
+    memcpy(p, desc->out_tags, tf.num_out * sizeof(ReportTypeTag));
+    p += tf.num_out * sizeof(ReportTypeTag);
+    memcpy(p, layout_ids.data(), ids_size);
+    p += ids_size;
+    memcpy(p, desc->name, tf.name_len);
+    p += tf.name_len;
+    memcpy(p, desc->in_types, tf.in_types_len);
+    p += tf.in_types_len;
+    memcpy(p, desc->out_types, tf.out_types_len);
+  });
+}
 
-      // there are some cases that the reported pointer is invalid,
-      // this will prevent the fuzzer from crashing
-      // ! still not working in qemu even with sigsetjmp
-      if (sigsetjmp(env, 1) == 0) {
-        if (ptr_level == 1) {
-          void *ptr = va_arg(args, void *);
-          param = to_string_ptr(ptr, base_type);
-        } else {
-          void **ptr = va_arg(args, void **);
-          param = to_string_ptr(ptr, base_type, ptr_level);
-        }
-      } else {
-        param = "ptr[]: pointer already freed";
+/**
+ * @brief Append the captured values of a new observation to the trace
+ * @param input_ref: hash of the function and the inputs of the observation
+ * @param hash: hash of the values
+ */
+void trace_captures(FuncInfo &func, bool is_rnt, const SlotCapture *captures,
+                    uint64_t input_ref, uint64_t hash) {
+  trace_func(func);
+  TraceValues tv;
+  tv.func_id = func.desc->id;
+  tv.num_values = is_rnt ? func.outputs.size() : func.inputs.size();
+  tv.input_ref = input_ref;
+  tv.hash = hash;
+  // with the deep captures stored behind them
+  size_t size = captures_size(captures, tv.num_values);
+  trace_writer().append(is_rnt ? TRACE_OUTPUT : TRACE_INPUT, sizeof(tv) + size,
+                        [&](char *p) {
+                          memcpy(p, &tv, sizeof(tv));
+                          memcpy(p + sizeof(tv), captures, size);
+                        });
+}
+
+/**
+ * @brief Store the captured values of a new observation
+ * @details formats them to strings right away, or with DEFER_REPORT_FORMAT
+ * copies the captures as they are and leaves formatting to the dump.
+ * @param is_rnt: true for outputs, false for inputs
+ * @param inputs: for outputs, the StoredValues of the inputs they belong to
+ */
+StoredValues store_captures(ValuePool &pool, FuncInfo &func, bool is_rnt,
+                            const SlotCapture *captures, StoredValues inputs) {
+  const vector<SlotInfo> &types = is_rnt ? func.outputs : func.inputs;
+  if (DEFER_REPORT_FORMAT) {
+    return pool.store(captures, captures_size(captures, types.size()),
+                      alignof(SlotCapture));
+  }
+  return pool.intern(format_captures(captures, types));
+}
+
+/**
+ * @brief Write values stored by store_captures as a JSON array of strings
+ * @param pool: pool the values are stored in
+ * @param func_id: ID of the function the values belong to
+ * @param is_rnt: true for outputs, false for inputs
+ * @param values: stored values
+ */
+void write_stored_values(JsonWriter &w, const ValuePool &pool,
+                         uint32_t func_id, bool is_rnt, StoredValues values) {
+  if (DEFER_REPORT_FORMAT) {
+    const FuncInfo &func = *func_registry().find(func_id);
+    w.strings(format_captures((const SlotCapture *)values,
+                              is_rnt ? func.outputs : func.inputs));
+    return;
+  }
+  IOSpan span = (IOSpan)values;
+  w.put('[');
+  for (uint32_t i = 1; i <= span[0]; i++) {
+    if (i > 1) {
+      w.put(',');
+    }
+    w.string(pool.value(span[i]), pool.value_len(span[i]));
+  }
+  w.put(']');
+}
+
+/**
+ * @brief Capture and hash the reported values of a call
+ * @details the hash does not depend on the function's ID, which changes
+ * with the order modules register in, so a REPORT_DB stays valid across runs.
+ * Deep captures are left in deep_scratch, see append_deep_captures.
+ * @param slots: raw values, see slot_cast
+ * @param types: decoded types of the values
+ * @param captures: captures to fill, one per value
+ * @return hash of the captures
+ */
+uint64_t capture_slots(const uint64_t *slots, const vector<SlotInfo> &types,
+                       SlotCapture *captures) {
+  uint64_t h = fast_hash_u64(0, types.size());
+  size_t budget = REPORT_CAPTURE_BYTES;
+  deep_scratch.clear();
+  for (size_t i = 0; i < types.size(); i++) {
+    capture_slot(slots[i], types[i], captures[i], budget);
+    h = hash_capture(h, captures[i], types[i], deep_scratch.data());
+  }
+  return h;
+}
+
+/**
+ * @brief Inputs of a reported call that has not returned yet
+ */
+struct PendingCall {
+  uint32_t func_id;
+  uint64_t input_hash;
+  // for deterministic functions called with inputs reported before, the
+  // number of distinct inputs of the function, the outputs are not captured
+  int known_inputs;
+  // set for calls of sampled functions that are not captured, the frame
+  // only pairs the return with its entry
+  bool skipped;
+  // the inputs are captures[offset, offset + len) of the shadow stack
+  uint32_t offset;
+  uint32_t len;
+};
+
+/**
+ * @brief Per-thread stack of the reported calls that have not returned yet
+ * @details function entry pushes the captured inputs and the matching return
+ * pops them, so recursive and nested calls are paired with their own inputs.
+ * Frames and captures are kept in two buffers that only grow, once they
+ * reach the deepest call depth pushing a frame does not allocate.
+ */
+class ShadowStack {
+private:
+  vector<PendingCall> frames;
+  vector<SlotCapture> captures;
+
+public:
+  /**
+   * @brief Push the frame of a function entry
+   * @return captures to fill with the call's len inputs
+   */
+  SlotCapture *push(uint32_t func_id, uint32_t len) {
+    uint32_t offset = captures.size();
+    frames.push_back(PendingCall{func_id, 0, 0, false, offset, len});
+    captures.resize(offset + len);
+    return captures.data() + offset;
+  }
+
+  /// @brief Store the deep captures of the frame just pushed behind it
+  void append_deep() { append_deep_captures(captures, frames.back().len); }
+
+  PendingCall &top() { return frames.back(); }
+
+  /**
+   * @brief Find the frame a return of a function belongs to
+   * @details frames above it belong to calls that were left without a
+   * return (longjmp, exceptions) and are dropped
+   * @return the frame, now on top of the stack, or null if the entry of the
+   * call was not reported
+   */
+  PendingCall *find(uint32_t func_id) {
+    size_t i = frames.size();
+    while (i > 0 && frames[i - 1].func_id != func_id) {
+      i--;
+    }
+    if (i == 0) {
+      return nullptr;
+    }
+    frames.resize(i);
+    return &frames.back();
+  }
+
+  const SlotCapture *inputs(const PendingCall &call) const {
+    return captures.data() + call.offset;
+  }
+
+  /// @brief Pop the frame on top of the stack
+  void pop() {
+    captures.resize(frames.back().offset);
+    frames.pop_back();
+  }
+};
+
+static thread_local ShadowStack shadow_stack;
+// outputs of the current return, only formatted if the observation is new
+static thread_local vector<SlotCapture> current_outputs;
+
+// this process joined shared_table, forked children join on their own
+static std::atomic<bool> shared_joined(false);
+
+__attribute__((constructor)) static void reset_shared_join_on_fork() {
+  pthread_atfork(nullptr, nullptr, [] { shared_joined = false; });
+}
+
+/**
+ * @brief Report an observation to shared_table, see update_current_reporting
+ */
+int report_shared(FuncInfo &func, const PendingCall &call,
+                  uint64_t output_hash) {
+  if (!shared_joined.load(std::memory_order_relaxed) &&
+      !shared_joined.exchange(true)) {
+    shared_table->join();
+  }
+  SharedFunc *shared = link_shared_func(func);
+  if (!shared) {
+    return 0;
+  }
+  return shared_table->report(
+      *shared, call.input_hash, output_hash,
+      [&](JsonWriter &w) {
+        w.strings(format_captures(shadow_stack.inputs(call), func.inputs));
+      },
+      [&](JsonWriter &w) {
+        w.strings(format_captures(current_outputs.data(), func.outputs));
+      });
+}
+
+/**
+ * @brief Append an observation to the trace unless it was traced recently,
+ * see update_current_reporting
+ * @details the observation is not kept, see TraceFilter
+ */
+int report_traced(FuncInfo &func, const PendingCall &call,
+                  uint64_t output_hash) {
+  // an empty slot of trace_filter holds 0
+  uint64_t input_ref = fast_hash_u64(call.input_hash, func.desc->id) | 1;
+  trace_filter().add(input_ref, output_hash, [&](bool new_inputs) {
+    if (new_inputs) {
+      trace_captures(func, false, shadow_stack.inputs(call), input_ref,
+                     call.input_hash);
+      // inputs traced again after they were evicted do not count again
+      if (MAX_REPORT_INPUTS > 0) {
+        std::lock_guard<std::mutex> guard(traced_inputs_lock);
+        new_inputs = traced_inputs.insert(input_ref).second;
+      }
+      if (new_inputs) {
+        func.traced_inputs.fetch_add(1, std::memory_order_relaxed);
       }
-    } else if (is_struct(types[0])) {
-      // * Struct Type
-      // todo: decode as the type of  first element
-      param = "a struct";
-    } else {
-      // other types just use type as input encoding
-      param = "Unknown Type Value";
     }
+    trace_captures(func, true, current_outputs.data(), input_ref,
+                   output_hash);
+  });
+  return func.traced_inputs.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Report an observation of a function unless it was reported before
+ * @param func: function that returned
+ * @param call: frame of the call on the shadow stack
+ * @param output_hash: hash of current_outputs
+ * @return number of distinct inputs reported for the function so far
+ */
+int update_current_reporting(FuncInfo &func, const PendingCall &call,
+                             uint64_t output_hash) {
+  if (REPORT_TRACE) {
+    return report_traced(func, call, output_hash);
+  }
+  if (shared_table) {
+    return report_shared(func, call, output_hash);
+  }
+  return report_table.report(
+      func.desc->id, func.name, call.input_hash, output_hash,
+      [&](ValuePool &pool) {
+        return store_captures(pool, func, false, shadow_stack.inputs(call),
+                              nullptr);
+      },
+      [&](ValuePool &pool, StoredValues inputs) {
+        pending_observations.fetch_add(1, std::memory_order_relaxed);
+        return store_captures(pool, func, true, current_outputs.data(),
+                              inputs);
+      });
+}
 
-    vs.push_back(param);
+/**
+ * @brief Mark a function saturated once it used up its report budget
+ * @details the instrumentation checks the flag before calling the reporter,
+ * so later calls of a saturated function only cost a load and a branch
+ * @param func: function whose call just returned
+ * @param num_inputs: number of distinct inputs reported for the function
+ */
+void saturate_if_exhausted(FuncInfo &func, int num_inputs) {
+  long calls = func.calls.fetch_add(1, std::memory_order_relaxed) + 1;
+  if ((MAX_REPORT_CALLS > 0 && calls >= MAX_REPORT_CALLS) ||
+      (MAX_REPORT_INPUTS > 0 && num_inputs >= MAX_REPORT_INPUTS)) {
+    __atomic_fetch_or(&func.desc->flags, REPORT_FLAG_SATURATED,
+                      __ATOMIC_RELAXED);
+    // other processes and later runs skip the function as well
+    if (SharedFunc *shared = func.shared.load(std::memory_order_relaxed)) {
+      shared->flags.fetch_or(SHARED_FUNC_SATURATED, std::memory_order_relaxed);
+    }
   }
-  va_end(args);
+}
 
-  update_current_reporting(is_rnt, vs, func_name);
+/**
+ * @brief Report the values of a function's inputs or outputs
+ * @param is_rnt: false at function entry, true at function exit
+ * @param id: function ID assigned at registration
+ * @param slots: raw values, see slot_cast
+ * @param len: number of values
+ */
+extern "C" int report_packed(bool is_rnt, uint32_t id, const uint64_t *slots,
+                             uint32_t len) {
+  if (SILENT_REPORTER)
+    return 0;
+  // functions of not yet registered modules have IDs out of range
+  FuncInfo *found = func_registry().find(id);
+  if (!found)
+    return 0;
+  FuncInfo &func = *found;
+  const vector<SlotInfo> &types = is_rnt ? func.outputs : func.inputs;
+  if (len != types.size())
+    return 0;
+
+  // capture into reused buffers, repeated observations do not allocate
+  if (!is_rnt) {
+    if ((func.desc->props & REPORT_PROP_SAMPLED) &&
+        func.entries.fetch_add(1, std::memory_order_relaxed) %
+                REPORT_SAMPLE_PERIOD !=
+            0) {
+      shadow_stack.push(id, 0);
+      shadow_stack.top().skipped = true;
+      return 0;
+    }
+    SlotCapture *inputs = shadow_stack.push(id, types.size());
+    PendingCall &call = shadow_stack.top();
+    call.input_hash = capture_slots(slots, types, inputs);
+    shadow_stack.append_deep();
+    // the outputs of a deterministic function were captured with the inputs
+    if ((func.desc->props & REPORT_PROP_DETERMINISTIC) && !shared_table &&
+        !REPORT_TRACE) {
+      call.known_inputs = report_table.known_inputs(id, call.input_hash);
+    }
+    return 0;
+  }
+
+  PendingCall *call = shadow_stack.find(id);
+  if (!call)
+    return 0;
+  if (call->skipped) {
+    shadow_stack.pop();
+    return 0;
+  }
+  if (call->known_inputs) {
+    saturate_if_exhausted(func, call->known_inputs);
+    shadow_stack.pop();
+    return 0;
+  }
+  current_outputs.resize(types.size());
+  uint64_t h = capture_slots(slots, types, current_outputs.data());
+  append_deep_captures(current_outputs, types.size());
+  saturate_if_exhausted(func, update_current_reporting(func, *call, h));
+  shadow_stack.pop();
+  if (flush_enabled()) {
+    maybe_flush();
+  }
   return 0;
-}
\ No newline at end of file
+}
+
+template <typename... Ts>
+static int report_typed(bool is_rnt, uint32_t id, Ts... vals) {
+  const uint64_t slots[] = {to_slot(vals)...};
+  return report_packed(is_rnt, id, slots, sizeof...(Ts));
+}
+
+// Entry points for up to two scalar values passed in registers,
+// the pass spills everything else into a buffer for report_packed.
+// Integers and pointers are passed as i64, floating-point values as double.
+extern "C" int report_i64(bool is_rnt, uint32_t id, uint64_t a) {
+  return report_typed(is_rnt, id, a);
+}
+extern "C" int report_f64(bool is_rnt, uint32_t id, double a) {
+  return report_typed(is_rnt, id, a);
+}
+extern "C" int report_i64_i64(bool is_rnt, uint32_t id, uint64_t a,
+                              uint64_t b) {
+  return report_typed(is_rnt, id, a, b);
+}
+extern "C" int report_i64_f64(bool is_rnt, uint32_t id, uint64_t a, double b) {
+  return report_typed(is_rnt, id, a, b);
+}
+extern "C" int report_f64_i64(bool is_rnt, uint32_t id, double a, uint64_t b) {
+  return report_typed(is_rnt, id, a, b);
+}
+extern "C" int report_f64_f64(bool is_rnt, uint32_t id, double a, double b) {
+  return report_typed(is_rnt, id, a, b);
+}
@@ -0,0 +1,215 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "JsonWriter.hpp"
+#include "SlotFormat.hpp"
+#include "TraceFile.hpp"
+
+// for convenience
+using namespace std;
+
+/// @brief Payload of a record in the mapped trace
+struct TracedRecord {
+  const char *p;
+  size_t size;
+  // TraceValues::hash
+  uint64_t hash;
+};
+
+struct TracedExec {
+  TracedRecord input;
+  vector<TracedRecord> outputs;
+};
+
+struct TracedExecs {
+  TracedFunc func;
+  // in the order they were traced, formatted only when they are written
+  vector<TracedExec> execs;
+};
+
+/**
+ * @brief Write the observations of the functions as the reporter dumps them
+ * @details the values are decoded from the trace as they are written
+ * @param malformed: incremented for each record that cannot be decoded
+ */
+static void write_report(JsonWriter &w, map<uint32_t, TracedExecs> &funcs,
+                         size_t &malformed) {
+  bool any_func = false;
+  for (auto &entry : funcs) {
+    TracedExecs &func = entry.second;
+    bool any_exec = false;
+    for (TracedExec &exec : func.execs) {
+      TraceValues tv;
+      IOVector values;
+      if (!decode_trace_values(exec.input.p, exec.input.size, func.func.inputs,
+                               tv, values)) {
+        malformed++;
+        continue;
+      }
+      if (!any_exec) {
+        w.write(any_func ? ",{" : "[{");
+        w.string(func.func.name);
+        w.write(":[");
+        any_func = true;
+      } else {
+        w.put(',');
+      }
+      any_exec = true;
+      w.put('[');
+      w.strings(values);
+      w.write(",[");
+      bool any_output = false;
+      for (TracedRecord &output : exec.outputs) {
+        if (!decode_trace_values(output.p, output.size, func.func.outputs, tv,
+                                 values)) {
+          malformed++;
+          continue;
+        }
+        if (any_output) {
+          w.put(',');
+        }
+        any_output = true;
+        w.strings(values);
+      }
+      w.write("]]");
+    }
+    if (any_exec) {
+      w.write("]}");
+    }
+  }
+  w.write(any_func ? "]" : "null");
+}
+
+/**
+ * @brief Convert a binary trace written with REPORT_TRACE to the JSON report
+ * the reporter dumps, usage: trace2json <trace> [<report>]
+ * @details the report is written to the trace name without ".<pid>.bin" by
+ * default. Inputs and observations traced more than once are written once,
+ * and like the reporter at most MAX_REPORT_SIZE outputs are kept for the
+ * same inputs.
+ */
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s <trace> [<report>]\n", argv[0]);
+    return 1;
+  }
+  size_t max_outputs = 10;
+  if (const char *env_p = getenv("MAX_REPORT_SIZE")) {
+    max_outputs = std::max(atoi(env_p), 1);
+  }
+  string trace_name = argv[1];
+  string report_name = argc == 3 ? argv[2] : trace_name;
+  if (argc == 2) {
+    size_t ext = report_name.rfind(".bin");
+    if (ext == string::npos || ext + 4 != report_name.size()) {
+      fprintf(stderr, "%s: no report name given\n", argv[0]);
+      return 1;
+    }
+    report_name.erase(ext);
+    // the pid of the process that wrote the trace
+    size_t pid = report_name.find_last_not_of("0123456789");
+    if (pid != string::npos && pid + 1 < report_name.size() &&
+        report_name[pid] == '.') {
+      report_name.erase(pid);
+    }
+  }
+
+  TraceReader reader;
+  if (const char *err = reader.open(trace_name.c_str())) {
+    fprintf(stderr, "%s: %s: %s\n", argv[0], trace_name.c_str(), err);
+    return 1;
+  }
+
+  // the records of a function and its values are not ordered across threads,
+  // read the functions first
+  map<uint32_t, TracedExecs> funcs;
+  TracedLayouts layouts;
+  size_t malformed = 0;
+  reader.for_each([&](TraceRecordType type, const char *p, size_t size) {
+    if (type == TRACE_LAYOUT && !layouts.decode(p, size)) {
+      malformed++;
+    } else if (type == TRACE_FUNC) {
+      TraceFunc tf;
+      TracedFunc func;
+      if (!decode_trace_func(p, size, tf, func, layouts)) {
+        malformed++;
+        return;
+      }
+      funcs[tf.func_id].func = func;
+    }
+  });
+
+  // input_ref -> (function, index of its exec)
+  unordered_map<uint64_t, pair<TracedExecs *, size_t>> inputs;
+  bool complete = reader.for_each([&](TraceRecordType type, const char *p,
+                                      size_t size) {
+    if (type != TRACE_INPUT && type != TRACE_OUTPUT) {
+      return;
+    }
+    if (size < sizeof(TraceValues)) {
+      malformed++;
+      return;
+    }
+    TraceValues tv;
+    memcpy(&tv, p, sizeof(tv));
+    auto found = funcs.find(tv.func_id);
+    if (found == funcs.end()) {
+      return;
+    }
+    TracedExecs &func = found->second;
+    TracedRecord record{p, size, tv.hash};
+    if (type == TRACE_INPUT) {
+      // the same inputs are traced again once the reporter forgot them
+      if (inputs.emplace(tv.input_ref, make_pair(&func, func.execs.size()))
+              .second) {
+        func.execs.push_back(TracedExec{record, {}});
+      }
+      return;
+    }
+    auto exec = inputs.find(tv.input_ref);
+    if (exec == inputs.end() || exec->second.first != &func) {
+      return;
+    }
+    vector<TracedRecord> &outputs = func.execs[exec->second.second].outputs;
+    if (outputs.size() >= max_outputs) {
+      return;
+    }
+    for (const TracedRecord &output : outputs) {
+      if (output.hash == record.hash) {
+        return;
+      }
+    }
+    outputs.push_back(record);
+  });
+  if (!complete) {
+    fprintf(stderr, "%s: %s ends with a truncated record\n", argv[0],
+            trace_name.c_str());
+  }
+
+  int fd = open(report_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "%s: cannot write %s\n", argv[0], report_name.c_str());
+    return 1;
+  }
+  JsonWriter w(fd);
+  write_report(w, funcs, malformed);
+  bool written = w.flush();
+  close(fd);
+  if (malformed > 0) {
+    fprintf(stderr, "%s: %s: %zu malformed records skipped\n", argv[0],
+            trace_name.c_str(), malformed);
+  }
+  if (!written) {
+    fprintf(stderr, "%s: cannot write %s\n", argv[0], report_name.c_str());
+    return 1;
+  }
+  return 0;
+}